@@ -0,0 +1,108 @@
+#include "channel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t channel_hash(char* name) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for(unsigned char* c = (unsigned char*)name; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 16777619u;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+// The i-th bit for a channel, by double hashing its id
+uint32_t bloom_bit(uint32_t channel, int i) {
+  uint32_t step = (channel >> 16) | (channel << 16) | 1;
+  return (channel + i * step) % BLOOM_BITS;
+}
+
+void bloom_clear(bloom_t* bloom) {
+  memset(bloom->bits, 0, BLOOM_BYTES);
+}
+
+void bloom_add(bloom_t* bloom, uint32_t channel) {
+  for(int i = 0; i < BLOOM_HASHES; i++) {
+    uint32_t bit = bloom_bit(channel, i);
+    bloom->bits[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+bool bloom_test(bloom_t* bloom, uint32_t channel) {
+  for(int i = 0; i < BLOOM_HASHES; i++) {
+    uint32_t bit = bloom_bit(channel, i);
+    if(!(bloom->bits[bit / 8] & (1 << (bit % 8)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void bloom_merge(bloom_t* into, bloom_t* from) {
+  for(int i = 0; i < BLOOM_BYTES; i++) {
+    into->bits[i] |= from->bits[i];
+  }
+}
+
+channel_set_t* channel_set_create() {
+  channel_set_t* set = malloc(sizeof(channel_set_t));
+  pthread_mutex_init(&set->m, NULL);
+  set->count = 0;
+  return set;
+}
+
+// Find a channel in the set by name. Caller holds the lock.
+int channel_find(channel_set_t* set, char* name) {
+  for(int i = 0; i < set->count; i++) {
+    if(strcmp(set->names[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool channel_join(channel_set_t* set, char* name) {
+  pthread_mutex_lock(&set->m);
+  bool changed = false;
+  if(channel_find(set, name) == -1 && set->count < MAX_CHANNELS) {
+    set->names[set->count] = strdup(name);
+    set->hashes[set->count] = channel_hash(name);
+    set->count++;
+    changed = true;
+  }
+  pthread_mutex_unlock(&set->m);
+  return changed;
+}
+
+bool channel_leave(channel_set_t* set, char* name) {
+  pthread_mutex_lock(&set->m);
+  int i = channel_find(set, name);
+  if(i != -1) {
+    free(set->names[i]);
+    set->count--;
+    set->names[i] = set->names[set->count];
+    set->hashes[i] = set->hashes[set->count];
+  }
+  pthread_mutex_unlock(&set->m);
+  return i != -1;
+}
+
+bool channel_subscribed(channel_set_t* set, uint32_t channel) {
+  pthread_mutex_lock(&set->m);
+  bool found = false;
+  for(int i = 0; i < set->count && !found; i++) {
+    found = set->hashes[i] == channel;
+  }
+  pthread_mutex_unlock(&set->m);
+  return found;
+}
+
+void channel_set_bloom(channel_set_t* set, bloom_t* bloom) {
+  pthread_mutex_lock(&set->m);
+  for(int i = 0; i < set->count; i++) {
+    bloom_add(bloom, set->hashes[i]);
+  }
+  pthread_mutex_unlock(&set->m);
+}
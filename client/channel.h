@@ -0,0 +1,81 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Named channels and the Bloom filters peers use to advertise them. Each
+ * peer sends its parent one filter covering its own channels and everything
+ * its children advertised, so a filter summarizes a whole subtree in a fixed
+ * BLOOM_BITS bits however many channels it holds. A relay forwards a channel
+ * message only to children whose filter might contain the channel. False
+ * positives cost a wasted hop; the receiver still checks its own channels
+ * exactly before showing anything.
+ */
+#define BLOOM_BITS 1024
+#define BLOOM_BYTES (BLOOM_BITS / 8)
+#define BLOOM_HASHES 4
+
+// The most channels one peer can join
+#define MAX_CHANNELS 64
+
+typedef struct bloom {
+  uint8_t bits[BLOOM_BYTES];
+} bloom_t;
+
+typedef struct channel_set {
+  pthread_mutex_t m;
+  char* names[MAX_CHANNELS];
+  uint32_t hashes[MAX_CHANNELS];
+  int count;
+} channel_set_t;
+
+/**
+ * Hash a channel name into the id carried by frames. Never 0, which means
+ * a message for everyone.
+ */
+uint32_t channel_hash(char* name);
+
+void bloom_clear(bloom_t* bloom);
+void bloom_add(bloom_t* bloom, uint32_t channel);
+bool bloom_test(bloom_t* bloom, uint32_t channel);
+
+/**
+ * Add every channel in one filter to another.
+ */
+void bloom_merge(bloom_t* into, bloom_t* from);
+
+/**
+ * Create an empty set of channels.
+ */
+channel_set_t* channel_set_create();
+
+/**
+ * Join a channel.
+ *
+ * \param name  The channel's name. Not owned by the set.
+ *
+ * \returns true if the set changed.
+ */
+bool channel_join(channel_set_t* set, char* name);
+
+/**
+ * Leave a channel.
+ *
+ * \returns true if the set changed.
+ */
+bool channel_leave(channel_set_t* set, char* name);
+
+/**
+ * Check whether a channel id belongs to a channel in the set.
+ */
+bool channel_subscribed(channel_set_t* set, uint32_t channel);
+
+/**
+ * Add every channel in the set to a filter.
+ */
+void channel_set_bloom(channel_set_t* set, bloom_t* bloom);
+
+#endif
@@ -10,6 +10,26 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <math.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "channel.h"
+#include "frame.h"
+#include "history.h"
+#include "link.h"
+#include "order.h"
+#include "pipeline.h"
+#include "probe.h"
+#include "race.h"
+#include "resolver.h"
+#include "search.h"
+#include "transfer.h"
+#include "tree.h"
 #include "ui.h"
 
 #define MAX_MSG_LENGTH 256
@@ -18,31 +38,53 @@
 #define RQNEW 2
 #define CEXIT 3
 
-pthread_mutex_t ui_lock = PTHREAD_MUTEX_INITIALIZER;
+// How many sessions with the same name can keep their own history at once
+#define MAX_HISTORY_SLOTS 16
+
+// The most matches shown for one \search command
+#define MAX_SEARCH_RESULTS 10
+
+// How many would-be parents we measure before joining, and how long we wait for them
+#define PROBE_SAMPLE 4
+#define PROBE_TIMEOUT_MS 500
+
+// Lookups run on this many threads, and we wait this long for one
+#define RESOLVER_WORKERS 2
+#define RESOLVE_TIMEOUT_MS 2000
+
+// How many children we take unless CHAT_MAX_CHILDREN says otherwise
+#define DEFAULT_MAX_CHILDREN 8
+
+// Relaying uses a fan-out worker per core, up to this many, unless CHAT_RELAY_WORKERS says otherwise
+#define DEFAULT_RELAY_WORKERS 4
+
+// Backoff between failed connections to the directory, doubling from the first, and when to give up
+#define DIRECTORY_BACKOFF_MS 100
+#define DIRECTORY_MAX_BACKOFF_MS 5000
+#define DIRECTORY_GIVE_UP_MS 60000
+// The longest we'll take a busy directory's word to wait
+#define DIRECTORY_MAX_RETRY_MS 30000
+
+// On \quit, how long we wait for queued frames to go out, and for our children to move
+#define LEAVE_FLUSH_MS 2000
+#define LEAVE_HANDOFF_MS 3000
+#define LEAVE_POLL_MS 10
 
 typedef struct message{
   char* msg;
   char* usr;
 }message_t;
 
-typedef struct client{
-  char* c_name;
-  int   sockfd;
-  pthread_mutex_t m;
-  FILE* input;
-  FILE* output;
-}client_t;
-
 typedef struct client_node
 {
-  struct client *c;
+  struct link *c;
   struct client_node* next;
 }client_list_t;
 
 typedef struct thread_arg {
   int socket_fd;
-  FILE* input;
-  char* client_name;
+  link_t* link;
+  bool is_parent;
 } thread_arg_t;
 
 typedef struct candidate{
@@ -50,6 +92,8 @@ typedef struct candidate{
   char* ip_addr;
   int id;
   int port_num;
+  char* zone;
+  struct sockaddr_in addr;
 }candidate_t;
 
 typedef struct candidate_list{
@@ -57,21 +101,90 @@ typedef struct candidate_list{
   struct candidate_list *next;
 }candidate_list_t;
 
-client_t parent;
+link_t* parent = NULL;
 client_list_t* c_list = NULL;
+// Held for reading while frames are sent, and for writing to add or drop a link
+pthread_rwlock_t links_lock = PTHREAD_RWLOCK_INITIALIZER;
 int client_count = 0;
-bool is_root = false;
+int max_children = DEFAULT_MAX_CHILDREN;
+// Children a leaving parent asked us to take over our limit, for siblings that fit nowhere else
+int extra_children = 0;
+// Set by a handoff thread as well as the main one
+atomic_bool is_root = false;
 int directory_id = -1;
 
+// Where our parent can be reached, and where it last told us we sit
+struct sockaddr_in parent_addr;
+pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+tree_place_t parent_place;
+bool has_place = false;
+
 char* my_name = "Anonymous";
 int my_port = 0;
 char* my_ip_addr = "";
-
-void* parent_thread_fn(void* args);
+// Where we are, e.g. a rack or region. Peers in the same zone are tried first.
+char* my_zone = "";
+// Our address as the directory sees it; peers reported at it are on our host
+struct in_addr my_host_addr;
+
+// Capabilities we offer on every link, and the count of frames we've created
+uint32_t my_caps = LINK_CAP_LZ | LINK_CAP_CREDIT | LINK_CAP_SHM;
+atomic_uint my_seq = 0;
+atomic_uint my_transfer_id = 0;
+
+// Looks up host names off the calling thread, and remembers them
+resolver_t* resolver = NULL;
+
+// Large messages and files we're receiving in chunks
+transfer_table_t* transfers = NULL;
+
+// Carries frames our neighbors send from their link threads to everyone else; see pipeline.h
+pipeline_t* pipeline = NULL;
+// Numbers the messages we send, and shows the ones we receive in order; see order.h
+order_t* order = NULL;
+
+// Channels we've joined, and the filter we last sent our parent for our subtree
+channel_set_t* my_channels = NULL;
+pthread_mutex_t interest_lock = PTHREAD_MUTEX_INITIALIZER;
+bloom_t advertised_interest;
+
+typedef struct send_arg {
+  uint8_t kind;
+  char* name;
+  char* text;
+} send_arg_t;
+
+// Every chat message seen by this peer, for scrollback and \search
+history_t* history = NULL;
+search_index_t* search = NULL;
+// Keeps history indexes and search postings in the same order
+pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* link_thread_fn(void* args);
+void relay_to_shard(frame_t* frame, link_t* from, int shard);
+void deliver_frame(frame_t* frame);
+void show_transfer(transfer_t* transfer);
 void* main_child_thread_fn(void* args);
-void* child_thread_fn(void* args);
 candidate_list_t* connect_to_directory(int port, char* ip_addr, int command);
-void connect_to_parent(candidate_list_t* candidates, int client_sock);
+bool resolve_address(char* host, int port, struct sockaddr_in* addr);
+void connect_to_parent(candidate_list_t* candidates);
+link_t* dial_parent(struct sockaddr_in* addrs, int count, int* winner);
+void adopt_parent(link_t* link, struct sockaddr_in* addr, bool hang_up);
+void free_candidate(candidate_t* candidate);
+void free_candidates(candidate_list_t* candidates);
+void relay_frame(frame_t* frame);
+void record_message(char* username, char* message);
+void show_search_results(char* query);
+void start_transfer(uint8_t kind, char* name, char* text);
+void advertise_interest(bool force);
+void post_to_channel(char* command);
+void* rebalance_thread_fn(void* args);
+void show_tree();
+history_t* open_history(char* dir);
+char* private_dir();
+void leave_tree(int server_sock);
+void send_handoff(link_t* link, struct sockaddr_in* to, uint16_t extra);
+void release_child(link_t* link);
 
 int main(int argc, char** argv) {
 
@@ -82,13 +195,29 @@ int main(int argc, char** argv) {
   // Initialize the chat client's user interface.
   ui_init();
   // Add a test message
-  pthread_mutex_lock(&ui_lock);
   ui_add_message(NULL, "Type your message and hit <ENTER> to post.");
-  pthread_mutex_unlock(&ui_lock);
+
+  // A neighbor that hangs up mid-write should drop its link, not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  // Peers started together must still jitter differently
+  srandom(time(NULL) ^ getpid());
+
+  // Compression can be turned off, e.g. to compare bandwidth
+  char* compress = getenv("CHAT_COMPRESS");
+  if(compress != NULL && strcmp(compress, "0") == 0){
+    my_caps &= ~LINK_CAP_LZ;
+  }
+
+  // CHAT_IO=uring sends for every TCP link from one thread through io_uring,
+  // falling back to a writer thread per link where the kernel doesn't have it
+  char* io = getenv("CHAT_IO");
+  if(io != NULL && strcmp(io, "uring") == 0 && link_use_uring() == -1){
+    ui_add_message(NULL, "io_uring is unavailable; using a writer thread per link.");
+  }
 
   int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-  int client_sock = socket(AF_INET, SOCK_STREAM, 0);
-  if(server_sock == -1 || client_sock == -1) {
+  if(server_sock == -1) {
     perror("socket");
     exit(2);
   }
@@ -117,6 +246,72 @@ int main(int argc, char** argv) {
 
   my_ip_addr = ipstr;
 
+  // Take shared memory channels from children on this host, unless CHAT_SHM=0
+  char* use_shm = getenv("CHAT_SHM");
+  char shm_name[64];
+  snprintf(shm_name, sizeof(shm_name), "chat-shm-%d", my_port);
+  if((use_shm != NULL && strcmp(use_shm, "0") == 0) || shm_listen(shm_name) == -1){
+    my_caps &= ~LINK_CAP_SHM;
+  }
+
+  // Keep history in files named for us, so it carries over from one session to the next
+  char* history_dir = getenv("CHAT_HISTORY_DIR");
+  if(history_dir == NULL){
+    history_dir = private_dir();
+  }
+  history = open_history(history_dir);
+  ui_set_history(history);
+
+  // Index anything left from an earlier session before new messages arrive
+  search = search_create();
+  uint64_t history_length = history_count(history);
+  for(uint64_t i = 0; i < history_length; i++){
+    history_entry_t entry;
+    if(history_get(history, i, &entry)){
+      search_add(search, i, entry.username, entry.message);
+      history_entry_free(&entry);
+    }
+  }
+
+  // Files are saved where other users can't plant a link in their place
+  char* download_dir = getenv("CHAT_DOWNLOAD_DIR");
+  if(download_dir == NULL){
+    download_dir = private_dir();
+  }
+  transfers = transfer_table_create(download_dir);
+  my_channels = channel_set_create();
+
+  char* workers = getenv("CHAT_RELAY_WORKERS");
+  int relay_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if(relay_workers > DEFAULT_RELAY_WORKERS){
+    relay_workers = DEFAULT_RELAY_WORKERS;
+  }
+  if(workers != NULL && atoi(workers) > 0){
+    relay_workers = atoi(workers);
+  }
+  // Messages are shown in each sender's order unless CHAT_ORDER says otherwise
+  char* ordering = getenv("CHAT_ORDER");
+  int order_mode = ORDER_FIFO;
+  if(ordering != NULL && strcmp(ordering, "none") == 0){
+    order_mode = ORDER_NONE;
+  }else if(ordering != NULL && strcmp(ordering, "causal") == 0){
+    order_mode = ORDER_CAUSAL;
+  }
+  order = order_create(order_mode, deliver_frame);
+  pipeline = pipeline_create(relay_workers, relay_to_shard, deliver_frame, order);
+
+  char* zone = getenv("CHAT_ZONE");
+  if(zone != NULL){
+    my_zone = zone;
+  }
+  char* children = getenv("CHAT_MAX_CHILDREN");
+  if(children != NULL && atoi(children) > 0){
+    max_children = atoi(children);
+  }
+
+  // Names in CHAT_HOSTS are answered without asking DNS
+  resolver = resolver_create(RESOLVER_WORKERS, getenv("CHAT_HOSTS"));
+
   candidate_list_t* candidates = connect_to_directory(atoi(argv[2]), argv[1], CJOIN);
 
   if(candidates==NULL){
@@ -124,251 +319,719 @@ int main(int argc, char** argv) {
   }
 
   if(!is_root){
-    connect_to_parent(candidates, client_sock);
+    connect_to_parent(candidates);
+    free_candidates(candidates);
   }
   // run child thread
   thread_arg_t* child_args = malloc(sizeof(thread_arg_t));
   child_args->socket_fd = server_sock;
-  child_args->client_name = my_name;
-  child_args->input = NULL;
+  child_args->link = NULL;
+  child_args->is_parent = false;
   pthread_t main_child_thread;
   if(pthread_create(&main_child_thread, NULL, main_child_thread_fn, child_args)) {
     perror("pthread_create failed");
     exit(EXIT_FAILURE);
   }
 
-  int error = 0;
-  socklen_t len = sizeof(error);
+  // Reshape the tree in the background as peers come and go
+  pthread_t rebalance_thread;
+  if(pthread_create(&rebalance_thread, NULL, rebalance_thread_fn, NULL)) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(rebalance_thread);
 
   while(true){
 
     // Read a message from the UI
     char* message = ui_read_input();
-    // If it is not the root check if parent is still connected otherise get a parent
-    if(!is_root){
-      int retval = getsockopt(client_sock, SOL_SOCKET, SO_ERROR, &error, &len);
-      int tolerance = 0;
-      while(retval != 0 && tolerance < 5){
-        retval = getsockopt(client_sock, SOL_SOCKET, SO_ERROR, &error, &len);
-        tolerance++;
-      }
-
-      if(retval!=0){
-        fprintf(stderr, "getsockopt failed.");
-        exit(2);
+    // If it is not the root check if parent is still connected otherise get a parent.
+    // The parent's link thread clears parent when the connection drops.
+    if(!is_root && parent == NULL){
+      candidate_list_t* new_candidates = connect_to_directory(atoi(argv[2]), argv[1], RQNEW);
+      if(new_candidates==NULL){
+        is_root = true;
       }
-
-      if(error != 0){
-
-        candidate_list_t* new_candidates = connect_to_directory(atoi(argv[2]), argv[1], RQNEW);
-        if(new_candidates==NULL){
-          is_root = true;
-        }
-        if(!is_root){
-          connect_to_parent(new_candidates, client_sock);
-        }
+      if(!is_root){
+        connect_to_parent(new_candidates);
+        free_candidates(new_candidates);
       }
     }
 
     // If the message is a quit command, shut down. Otherwise print the message
     if(strcmp(message, "\\quit") == 0) {
+      // Our children move before the directory forgets us, so none of them has to ask it
+      leave_tree(server_sock);
       connect_to_directory(atoi(argv[2]), argv[1], CEXIT);
       break;
-    } else if(strlen(message) > 0) {
-      // Add the message to the UI
-      pthread_mutex_lock(&ui_lock);
-      ui_add_message(my_name, message);
-      pthread_mutex_unlock(&ui_lock);
-      size_t message_length = strlen(message);
-      size_t name_length    = strlen(my_name);
-      char *named_message = (char*)malloc((name_length + message_length)*sizeof(char) + 2);
-      strcpy(named_message, my_name);
-      strcpy(named_message+name_length, "#!");
-      strcpy(named_message+name_length+2, message);
-      if(!is_root){
-        pthread_mutex_lock(&(parent.m));
-        fprintf(parent.output, "%s\n", named_message);
-        fflush(parent.output);
-        pthread_mutex_unlock(&(parent.m));
+    } else if(strcmp(message, "\\tree") == 0) {
+      show_tree();
+    } else if(strncmp(message, "\\search ", 8) == 0) {
+      show_search_results(message + 8);
+    } else if(strncmp(message, "\\join ", 6) == 0) {
+      if(channel_join(my_channels, message + 6)){
+        advertise_interest(false);
       }
-      // propagate 'my_msg' to children
-      client_list_t* temp = c_list;
-      while(temp != NULL){
-        pthread_mutex_lock(&(temp->c->m));
-        fprintf(temp->c->output, "%s\n", named_message);
-        fflush(temp->c->output);
-        pthread_mutex_unlock(&(temp->c->m));
-        temp = temp->next;
+    } else if(strncmp(message, "\\leave ", 7) == 0) {
+      if(channel_leave(my_channels, message + 7)){
+        advertise_interest(false);
       }
-      free(named_message);
+    } else if(strncmp(message, "\\to ", 4) == 0) {
+      post_to_channel(message + 4);
+    } else if(strncmp(message, "\\send ", 6) == 0) {
+      start_transfer(TRANSFER_FILE, message + 6, NULL);
+    } else if(strlen(message) > TRANSFER_CHUNK_SIZE) {
+      // Too big for one frame, so it streams through the tree in chunks
+      record_message(my_name, message);
+      start_transfer(TRANSFER_TEXT, "message", message);
+    } else if(strlen(message) > 0) {
+      // Add the message to the UI
+      record_message(my_name, message);
+      // Compress once here; relays pass the frame on without touching it
+      frame_t* frame = frame_message(directory_id, atomic_fetch_add(&my_seq, 1), my_name, message,
+                                     my_caps & LINK_CAP_LZ);
+      order_stamp(order, frame);
+      relay_frame(frame);
+      frame_free(frame);
     }
   }
   // Free the message
   //free(message);
   // Clean up the UI
   close(server_sock);
-  close(client_sock);
-  while(c_list != NULL){
-    close(c_list->c->sockfd);
-    c_list = c_list->next;
+  pthread_rwlock_wrlock(&links_lock);
+  if(parent != NULL){
+    shutdown(parent->sockfd, SHUT_RDWR);
+  }
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    shutdown(temp->c->sockfd, SHUT_RDWR);
   }
+  pthread_rwlock_unlock(&links_lock);
   ui_shutdown();
+  search_destroy(search);
+  history_close(history);
+}
+
+// Open our history in dir. It's named for us, so the next session with the same name picks it up;
+// a second session with the same name running at once gets the next numbered history instead.
+// A directory of ours in /tmp that no one else can read or write
+char* private_dir(){
+  static char path[64];
+  snprintf(path, sizeof(path), "/tmp/chat-%u", (unsigned)getuid());
+  if(mkdir(path, 0700) == -1 && errno != EEXIST){
+    perror("mkdir failed");
+    exit(EXIT_FAILURE);
+  }
+  // Someone else may have made it first, to read or replace what we put there
+  struct stat st;
+  if(lstat(path, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0){
+    fprintf(stderr, "%s is not a private directory\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return path;
 }
 
-void* parent_thread_fn(void* p){
+history_t* open_history(char* dir){
+  // Only characters that can't leave dir or hide the file go into its name
+  char name[MAX_MSG_LENGTH];
+  snprintf(name, sizeof(name), "%s", my_name);
+  for(char* c = name; *c != '\0'; c++){
+    if(!isalnum((unsigned char)*c) && *c != '-' && *c != '_'){
+      *c = '_';
+    }
+  }
+
+  char path[PATH_MAX];
+  for(int slot = 0; slot < MAX_HISTORY_SLOTS; slot++){
+    if(slot == 0){
+      snprintf(path, sizeof(path), "%s/chat-%s", dir, name);
+    }else{
+      snprintf(path, sizeof(path), "%s/chat-%s.%d", dir, name, slot);
+    }
+    history_t* opened = history_open(path);
+    if(opened != NULL){
+      return opened;
+    }
+  }
+  fprintf(stderr, "Unable to open history %s\n", path);
+  exit(EXIT_FAILURE);
+}
+
+// Add a chat message to the history and search index, then display it
+void record_message(char* username, char* message){
+  if(message == NULL){
+    message = "";
+  }
+  pthread_mutex_lock(&record_lock);
+  uint64_t index = history_append(history, username, message);
+  search_add(search, index, username, message);
+  pthread_mutex_unlock(&record_lock);
+  ui_add_message(username, message);
+}
+
+// Show the newest messages matching every word in the query
+void show_search_results(char* query){
+  uint64_t results[MAX_SEARCH_RESULTS];
+  size_t found = search_query(search, query, results, MAX_SEARCH_RESULTS);
+
+  char summary[MAX_MSG_LENGTH];
+  snprintf(summary, sizeof(summary), "%zu newest matches for \"%s\":", found, query);
+  ui_add_message(NULL, summary);
+
+  // Oldest first, so the newest match ends up at the bottom
+  for(size_t i = found; i > 0; i--){
+    history_entry_t entry;
+    if(history_get(history, results[i-1], &entry)){
+      size_t line_length = strlen(entry.message) + 32;
+      if(entry.username != NULL){
+        line_length += strlen(entry.username);
+      }
+      char* line = malloc(line_length);
+      snprintf(line, line_length, "#%llu %s: %s", (unsigned long long)results[i-1],
+               entry.username == NULL ? "" : entry.username, entry.message);
+      ui_add_message(NULL, line);
+      free(line);
+      history_entry_free(&entry);
+    }
+  }
+}
+
+// Free the frame a decompressed copy was made from, once the copy is freed too
+void release_original(void* arg, uint8_t type){
+  frame_free((frame_t*)arg);
+}
+
+// Send a frame to one link, decompressing it first if the link can't take it as-is
+void send_to_link(link_t* link, frame_t* frame, frame_t** plain, bool wait){
+  if((frame->flags & FRAME_COMPRESSED) && !(link->caps & LINK_CAP_LZ)){
+    // Decompress at most once per frame, however many links need it
+    if(*plain == NULL){
+      *plain = frame_decompressed(frame);
+      // The original's release returns the credit it came in on, so it lives as long as the copy
+      if(*plain != NULL){
+        (*plain)->on_release = release_original;
+        (*plain)->release_arg = frame_retain(frame);
+      }
+    }
+    if(*plain == NULL){
+      return;
+    }
+    frame = *plain;
+  }
+  if(wait){
+    link_send_wait(link, frame);
+  }else{
+    link_send(link, frame);
+  }
+}
+
+// Whether a frame goes to a neighbor: one a fan-out worker owns (any if shard is -1), other than
+// the one it came from, and for a child, one whose subtree wants its channel. Caller holds links_lock.
+bool relay_wanted(link_t* link, frame_t* frame, link_t* from, int shard){
+  if(link == from || (shard != -1 && link->shard != shard)){
+    return false;
+  }
+  // A child that moved up hears everything through its new parent, which is ours
+  if(link->moved){
+    return false;
+  }
+  // Skip subtrees that told us they don't want this channel
+  return link == parent || frame->channel == 0 || !link->has_interest ||
+         bloom_test(&link->interest, frame->channel);
+}
+
+// Send a frame to every neighbor a fan-out worker owns (every neighbor if shard is -1),
+// except the one it came from (NULL if it's ours)
+void relay_to_shard(frame_t* frame, link_t* from, int shard){
+  frame_t* plain = NULL;
+  // Our own transfers wait for room, which is what slows a sender to the tree's pace.
+  // Relayed frames never wait; credit already bounds them. Nor does chat, so the UI never stalls.
+  bool wait = from == NULL && link_class(frame) == LINK_CLASS_BULK;
+  // Every copy goes out in one io_uring submission rather than one write per link
+  link_batch_begin();
+  pthread_rwlock_rdlock(&links_lock);
+  if(!wait){
+    if(parent != NULL && relay_wanted(parent, frame, from, shard)){
+      send_to_link(parent, frame, &plain, false);
+    }
+    for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+      if(relay_wanted(temp->c, frame, from, shard)){
+        send_to_link(temp->c, frame, &plain, false);
+      }
+    }
+    pthread_rwlock_unlock(&links_lock);
+  }else{
+    // Room comes with credit, which a link's reader delivers, and readers take links_lock to
+    // write. So we wait on a snapshot of the links, never under the lock.
+    int count = 1;
+    for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+      count++;
+    }
+    link_t** targets = malloc(sizeof(link_t*) * count);
+    int n = 0;
+    if(parent != NULL && relay_wanted(parent, frame, from, shard)){
+      targets[n++] = link_retain(parent);
+    }
+    for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+      if(relay_wanted(temp->c, frame, from, shard)){
+        targets[n++] = link_retain(temp->c);
+      }
+    }
+    pthread_rwlock_unlock(&links_lock);
+    for(int i = 0; i < n; i++){
+      // A link dropped meanwhile is broken or closing, so this returns straight away
+      send_to_link(targets[i], frame, &plain, true);
+      link_release(targets[i]);
+    }
+    free(targets);
+  }
+  link_batch_end();
+  frame_free(plain);
+}
+
+// Send a frame we created to every neighbor
+void relay_frame(frame_t* frame){
+  // Noted first, so a copy the tree hands back to us is known as ours
+  pipeline_record(pipeline, frame);
+  relay_to_shard(frame, NULL, -1);
+}
+
+// Show or store a frame a neighbor sent; the pipeline has already passed it on
+void deliver_frame(frame_t* frame){
+  if(frame->type == FRAME_MSG){
+    // Messages on channels we haven't joined are only passing through to a subtree that wants them
+    if(frame->channel != 0 && !channel_subscribed(my_channels, frame->channel)){
+      return;
+    }
+    char* username;
+    char* message;
+    if(frame_open_message(frame, &username, &message) == 0){
+      record_message(username, message);
+      free(username);
+      free(message);
+    }
+  }else{
+    transfer_t* done = transfer_receive(transfers, frame);
+    if(done != NULL){
+      show_transfer(done);
+      transfer_free(done);
+    }
+  }
+}
+
+// Tell our parent which channels our subtree wants, if that has changed
+void advertise_interest(bool force){
+  bloom_t interest;
+  bloom_clear(&interest);
+  channel_set_bloom(my_channels, &interest);
+
+  pthread_mutex_lock(&interest_lock);
+  pthread_rwlock_rdlock(&links_lock);
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    // A child that hasn't said yet might want anything, but it will say soon
+    if(temp->c->has_interest){
+      bloom_merge(&interest, &temp->c->interest);
+    }
+  }
+  bool changed = memcmp(&interest, &advertised_interest, sizeof(bloom_t)) != 0;
+  if(parent != NULL && (changed || force)){
+    frame_t* sub = frame_create(FRAME_SUB, directory_id, 0, (char*)interest.bits, BLOOM_BYTES);
+    link_send(parent, sub);
+    frame_free(sub);
+  }
+  pthread_rwlock_unlock(&links_lock);
+  advertised_interest = interest;
+  pthread_mutex_unlock(&interest_lock);
+}
+
+// Post "<channel> <message>" to a channel. Only its subscribers will see it.
+void post_to_channel(char* command){
+  char* space = strchr(command, ' ');
+  if(space == NULL || space[1] == '\0'){
+    ui_add_message(NULL, "Usage: \\to <channel> <message>");
+    return;
+  }
+  *space = '\0';
+  char* channel = command;
+  char* text = space + 1;
+  if(strlen(text) > TRANSFER_CHUNK_SIZE){
+    ui_add_message(NULL, "Channel messages must fit in one chunk.");
+    return;
+  }
+
+  // Tag the text with the channel so readers can tell where it was posted
+  size_t length = strlen(channel) + strlen(text) + 4;
+  char* tagged = malloc(length);
+  snprintf(tagged, length, "[%s] %s", channel, text);
+  record_message(my_name, tagged);
+
+  frame_t* frame = frame_message(directory_id, atomic_fetch_add(&my_seq, 1), my_name, tagged,
+                                 my_caps & LINK_CAP_LZ);
+  frame->channel = channel_hash(channel);
+  order_stamp(order, frame);
+  relay_frame(frame);
+  frame_free(frame);
+  free(tagged);
+}
+
+// Take a link out of the tree once its connection is gone, and free it
+void drop_link(link_t* link){
+  pthread_rwlock_wrlock(&links_lock);
+  if(parent == link){
+    parent = NULL;
+  }
+  client_list_t** p = &c_list;
+  while(*p != NULL){
+    if((*p)->c == link){
+      client_list_t* dead = *p;
+      *p = dead->next;
+      free(dead);
+      // A child that left on purpose already gave up its place
+      if(!link->leaving){
+        client_count--;
+      }
+      break;
+    }
+    p = &(*p)->next;
+  }
+  pthread_rwlock_unlock(&links_lock);
+  link_close(link);
+}
+
+// Display a transfer that has finished arriving
+void show_transfer(transfer_t* transfer){
+  if(transfer->kind == TRANSFER_TEXT){
+    record_message(transfer->username, transfer->data);
+  }else{
+    char notice[PATH_MAX + MAX_MSG_LENGTH];
+    snprintf(notice, sizeof(notice), "%s sent %s (%llu bytes), saved to %s", transfer->username,
+             transfer->name, (unsigned long long)transfer->total, transfer->path);
+    ui_add_message(NULL, notice);
+  }
+}
+
+// Stream a file or long message to the tree one chunk at a time
+void* send_transfer_thread_fn(void* p){
+  send_arg_t* args = (send_arg_t*)p;
+  int fd = -1;
+  uint64_t total;
+  if(args->kind == TRANSFER_FILE){
+    fd = open(args->name, O_RDONLY);
+    total = fd == -1 ? 0 : lseek(fd, 0, SEEK_END);
+    if(total == 0 || total == (uint64_t)-1){
+      ui_add_message(NULL, "Unable to send: file is missing or empty.");
+      goto done;
+    }
+    if(total > TRANSFER_MAX_FILE_SIZE){
+      ui_add_message(NULL, "Unable to send: file is too big.");
+      goto done;
+    }
+  }else{
+    total = strlen(args->text);
+  }
+
+  uint32_t id = atomic_fetch_add(&my_transfer_id, 1);
+  frame_t* start = transfer_start_frame(directory_id, atomic_fetch_add(&my_seq, 1), id,
+                                        args->kind, total, my_name, args->name);
+  relay_frame(start);
+  frame_free(start);
+
+  // Read one chunk at a time, so sending never holds the whole payload
+  char* chunk = malloc(TRANSFER_CHUNK_SIZE);
+  uint32_t chunks = (total + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+  for(uint32_t i = 0; i < chunks; i++){
+    uint64_t offset = (uint64_t)i * TRANSFER_CHUNK_SIZE;
+    uint32_t length = total - offset < TRANSFER_CHUNK_SIZE ? total - offset : TRANSFER_CHUNK_SIZE;
+    char* data = chunk;
+    if(args->kind == TRANSFER_FILE){
+      if(pread(fd, chunk, length, offset) != length){
+        ui_add_message(NULL, "Unable to send: file could not be read.");
+        break;
+      }
+    }else{
+      data = args->text + offset;
+    }
+    frame_t* frame = transfer_chunk_frame(directory_id, atomic_fetch_add(&my_seq, 1), id, i,
+                                          data, length, my_caps & LINK_CAP_LZ);
+    relay_frame(frame);
+    frame_free(frame);
+  }
+  free(chunk);
+
+  if(args->kind == TRANSFER_FILE){
+    char notice[PATH_MAX + MAX_MSG_LENGTH];
+    snprintf(notice, sizeof(notice), "Sent %s (%llu bytes)", args->name, (unsigned long long)total);
+    ui_add_message(NULL, notice);
+  }
+done:
+  if(fd != -1){
+    close(fd);
+  }
+  free(args->name);
+  free(args->text);
+  free(args);
+  return NULL;
+}
+
+// Send a file or long message in the background so the UI stays responsive
+void start_transfer(uint8_t kind, char* name, char* text){
+  send_arg_t* args = malloc(sizeof(send_arg_t));
+  args->kind = kind;
+  args->name = strdup(name);
+  args->text = text == NULL ? NULL : strdup(text);
+  pthread_t send_thread;
+  if(pthread_create(&send_thread, NULL, send_transfer_thread_fn, args)) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(send_thread);
+}
+
+typedef struct handoff_arg {
+  link_t* old;
+  struct sockaddr_in to;
+} handoff_arg_t;
+
+// Move to where a leaving parent handed us, or become the root, then tell it we've gone
+void* handoff_thread_fn(void* p){
+  handoff_arg_t* args = (handoff_arg_t*)p;
+  link_t* old = args->old;
+  if(args->to.sin_port == 0){
+    // It stays our parent until it hangs up, so our siblings still hear us until they move
+    is_root = true;
+    ui_add_message(NULL, "Our parent left; we are now the root.");
+  }else{
+    // Keep reading the old parent meanwhile; anything that comes both ways is dropped as a duplicate.
+    // If this fails, we ask the directory once the old parent hangs up.
+    int winner;
+    link_t* link = dial_parent(&args->to, 1, &winner);
+    if(link != NULL){
+      adopt_parent(link, &args->to, false);
+    }
+  }
+  // What we'd already queued for it goes before we say we're done with it
+  link_flush(old, LEAVE_FLUSH_MS);
+  send_handoff(old, NULL, 0);
+  link_release(old);
+  free(args);
+  return NULL;
+}
+
+// Send what we'd queued for a child that moved away, then hang up on it
+void* release_child_thread_fn(void* p){
+  link_t* link = (link_t*)p;
+  link_flush(link, LEAVE_FLUSH_MS);
+  // Its link thread sees the hangup and frees it
+  shutdown(link->sockfd, SHUT_RDWR);
+  link_release(link);
+  return NULL;
+}
+
+// The child's link thread has to keep reading credit while its queue empties, so that happens on another
+void release_child(link_t* link){
+  pthread_t release_thread;
+  if(pthread_create(&release_thread, NULL, release_child_thread_fn, link_retain(link))) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(release_thread);
+}
+
+// Our parent is leaving. Its link thread has to keep reading, so the move happens on another.
+void take_handoff(link_t* old, struct sockaddr_in* to, uint16_t extra){
+  pthread_rwlock_wrlock(&links_lock);
+  bool current = parent == old;
+  if(current){
+    // Our siblings may be on their way already
+    extra_children += extra;
+  }
+  pthread_rwlock_unlock(&links_lock);
+  if(!current){
+    // We've already moved away from it
+    return;
+  }
+  handoff_arg_t* args = malloc(sizeof(handoff_arg_t));
+  args->old = link_retain(old);
+  args->to = *to;
+  pthread_t handoff_thread;
+  if(pthread_create(&handoff_thread, NULL, handoff_thread_fn, args)) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(handoff_thread);
+}
+
+void* link_thread_fn(void* p){
   // Unpack the thread arguments
   thread_arg_t* args = (thread_arg_t*)p;
-  int socket_fd = args->socket_fd;
-  char* client_name = args->client_name;
-  //free(args);
-  // Read lines until we hit the end of the input (the client disconnects)
-  char* line = NULL;
-  size_t linecap = 0;
-  while(getline(&line, &linecap, parent.input) > 0) {
-    char *parse_line  = strdup(line);
-    char *parent_name = strtok(parse_line, "#!");
-    char *parent_msg  = strtok(NULL, "#!");
-    pthread_mutex_lock(&ui_lock);
-    ui_add_message(parent_name, parent_msg);
-    pthread_mutex_unlock(&ui_lock);
-    //propogate 'new_msg' to all children
-    client_list_t* temp = c_list;
-    while(temp != NULL){
-      pthread_mutex_lock(&(temp->c->m));
-      fprintf(temp->c->output, "%s", line);
-      fflush(temp->c->output);
-      pthread_mutex_unlock(&(temp->c->m));
-      temp = temp->next;
-    }
-  }
-  // When we're done, we should free the line from getline
-  //free(line);
+  link_t* link = args->link;
+  bool is_parent = args->is_parent;
+  free(args);
+
+  // A new child must agree on capabilities before it joins the tree
+  if(!is_parent){
+    frame_t* first = link_recv(link);
+    if(first != NULL && first->type == FRAME_PING){
+      // A peer choosing a parent is measuring us; tell it how much room we have
+      pthread_rwlock_rdlock(&links_lock);
+      uint32_t spare = htonl(client_count < max_children ? max_children - client_count : 0);
+      pthread_rwlock_unlock(&links_lock);
+      frame_t* pong = frame_create(FRAME_PONG, directory_id, 0, (char*)&spare, sizeof(spare));
+      link_send(link, pong);
+      frame_free(pong);
+      frame_free(first);
+      link_close(link);
+      return NULL;
+    }
 
+    // Hold a place for the child while it handshakes; a full peer just hangs up
+    pthread_rwlock_wrlock(&links_lock);
+    bool room = client_count < max_children;
+    if(!room && extra_children > 0){
+      extra_children--;
+      room = true;
+    }
+    if(room){
+      client_count++;
+    }
+    pthread_rwlock_unlock(&links_lock);
+    if(!room || link_accept(link, first, my_caps) == -1){
+      if(room){
+        pthread_rwlock_wrlock(&links_lock);
+        client_count--;
+        pthread_rwlock_unlock(&links_lock);
+      }
+      frame_free(first);
+      link_close(link);
+      return NULL;
+    }
+    frame_free(first);
+
+    client_list_t* newnode = (client_list_t*)malloc(sizeof(client_list_t));
+    newnode->c = link;
+    link->shard = pipeline_assign(pipeline);
+    pthread_rwlock_wrlock(&links_lock);
+    newnode->next = c_list;
+    c_list = newnode;
+    pthread_rwlock_unlock(&links_lock);
+  }
+
+  // Read frames until the neighbor disconnects
+  frame_t* frame;
+  while((frame = link_recv(link)) != NULL) {
+    if(frame->type == FRAME_MSG || frame->type == FRAME_XFER || frame->type == FRAME_CHUNK){
+      // Relayed and handled on the pipeline's threads, so this one can get back to reading
+      pipeline_submit(pipeline, frame_retain(frame), link);
+    }else if(frame->type == FRAME_SUB && !is_parent && frame->length == BLOOM_BYTES){
+      // A child's subtree changed what it wants; fold that into our own summary
+      pthread_rwlock_wrlock(&links_lock);
+      memcpy(link->interest.bits, frame->payload, BLOOM_BYTES);
+      link->has_interest = true;
+      pthread_rwlock_unlock(&links_lock);
+      advertise_interest(false);
+    }else if(frame->type == FRAME_SUMMARY && !is_parent){
+      tree_summary_t summary;
+      if(tree_read_summary(frame, &summary) == 0){
+        pthread_rwlock_wrlock(&links_lock);
+        link->peer_id = frame->origin;
+        link->subtree_size = summary.size;
+        link->subtree_height = summary.height;
+        link->peer_spare = summary.spare;
+        link->peer_port = summary.port;
+        pthread_rwlock_unlock(&links_lock);
+      }
+    }else if(frame->type == FRAME_HANDOFF && !is_parent){
+      // The child is leaving, or has moved away from us; either way it's not ours
+      struct sockaddr_in to;
+      uint16_t extra;
+      bool moved = tree_read_handoff(frame, &to, &extra) == 0 && to.sin_port != 0;
+      pthread_rwlock_wrlock(&links_lock);
+      if(!link->leaving){
+        link->leaving = true;
+        client_count--;
+      }
+      link->moved = link->moved || moved;
+      pthread_rwlock_unlock(&links_lock);
+      if(moved){
+        release_child(link);
+      }
+    }else if(frame->type == FRAME_HANDOFF && is_parent){
+      struct sockaddr_in to;
+      uint16_t extra;
+      if(tree_read_handoff(frame, &to, &extra) == 0){
+        take_handoff(link, &to, extra);
+      }
+    }else if(frame->type == FRAME_PLACE && is_parent){
+      tree_place_t place;
+      // A parent we've been handed away from may still say where we were
+      if(tree_read_place(frame, &place) == 0 && parent == link){
+        pthread_mutex_lock(&tree_lock);
+        parent_place = place;
+        has_place = true;
+        pthread_mutex_unlock(&tree_lock);
+      }
+    }
+    frame_free(frame);
+  }
+
+  drop_link(link);
+  if(!is_parent){
+    // Whatever that child wanted is no longer our subtree's business
+    advertise_interest(false);
+  }
   return NULL;
 }
 
 void* main_child_thread_fn(void* p){
+  thread_arg_t* child_args = (thread_arg_t*)p;
+  int server_sock = child_args->socket_fd;
   while(true){
-    thread_arg_t* child_args = (thread_arg_t*)p;
-    int server_sock = child_args->socket_fd;
-    char* client_name = child_args->client_name;
     // Accept a client connection
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(struct sockaddr_in);
     int client_socket = accept(server_sock, (struct sockaddr*)&client_addr, &client_addr_len);
-
-    // create struct for client
-    client_t *newclient = (client_t*)malloc(sizeof(client_t));
-    newclient->sockfd = client_socket;
-    newclient->c_name = "client";
-    pthread_mutex_init(&newclient->m, NULL);
-    // Duplicate the socket_fd so we can open it twice, once for input and once for output
-    int client_socket_copy = dup(client_socket);
-    if(client_socket_copy == -1) {
-      perror("dup failed 1");
-      exit(EXIT_FAILURE);
-    }
-
-    // Open the socket as a FILE stream so we can use fgets
-    FILE* client_input = fdopen(client_socket, "r");
-    FILE* client_output = fdopen(client_socket_copy, "w");
-
-    // Check for errors
-    if(client_input == NULL || client_output == NULL) {
-      perror("fdopen failed");
-      exit(EXIT_FAILURE);
+    if(client_socket == -1){
+      // The listening socket is closed when we shut down
+      break;
     }
-    newclient->input = client_input;
-    newclient->output = client_output;
-    // add client to list of clients
-    client_list_t* newnode = (client_list_t*)malloc(sizeof(client_list_t));
-    newnode->c = newclient;
-    newnode->next = c_list;
-    c_list = newnode;
 
-    // Set up arguments for the client thread
+    // Set up arguments for the client thread, which finishes the handshake
     thread_arg_t* args = malloc(sizeof(thread_arg_t));
     args->socket_fd = client_socket;
-    args->client_name = "a";
-    args->input = client_input;
+    args->link = link_open(client_socket, "client");
+    args->is_parent = false;
 
     // Create the child thread
     pthread_t child_thread;
-    if(pthread_create(&child_thread, NULL, child_thread_fn, args)) {
+    if(pthread_create(&child_thread, NULL, link_thread_fn, args)) {
       perror("pthread_create failed");
       exit(EXIT_FAILURE);
     }
-    client_count++;
+    pthread_detach(child_thread);
   }
   return NULL;
 }
 
-void* child_thread_fn(void* p){
-  // Unpack the thread arguments
-  thread_arg_t* args = (thread_arg_t*) p;
-  int socket_fd = args->socket_fd;
-  char* client_name = args->client_name;
-  FILE* input = args->input;
-  //free(args);
-  // Read lines until we hit the end of the input (the client disconnects)
-  char* line = NULL;
-  size_t linecap = 0;
-  while(getline(&line, &linecap, input) > 0) {
-    //propogate 'new_msg' to all children
-    char *parse_line = strdup(line);
-    char *child_name = strtok(parse_line, "#!");
-    char *child_msg  = strtok(NULL, "#!");
-    pthread_mutex_lock(&ui_lock);
-    ui_add_message(child_name, child_msg);
-    pthread_mutex_unlock(&ui_lock);
-    if(!is_root){
-      pthread_mutex_lock(&(parent.m));
-      fprintf(parent.output, "%s", line);
-      fflush(parent.output);
-      pthread_mutex_unlock(&(parent.m));
-    }
-    client_list_t* temp = c_list;
-    while(temp != NULL){
-      if(temp->c->sockfd != socket_fd){
-        pthread_mutex_lock(&(temp->c->m));
-        fprintf(temp->c->output, "%s", line);
-        fflush(temp->c->output);
-        pthread_mutex_unlock(&(temp->c->m));
-      }
-      temp = temp->next;
-    }
-  }
-  // When we're done, we should free the line from getline
-  //free(line);
-
-  return NULL;
-}
-
-candidate_list_t* connect_to_directory(int port, char* ip_addr, int command){
+// Make one request of the directory. Returns 0 once it's answered, filling in any candidates,
+// the time it asked us to wait if it was too busy, or -1 if it couldn't be reached.
+int directory_request(int port, char* ip_addr, int command, candidate_list_t** candidates){
   int client_sock = socket(AF_INET, SOCK_STREAM, 0);
   if(client_sock == -1){
     perror("socket failed.");
     exit(EXIT_FAILURE);
   }
 
-  // Initialize socket address (with address to be specified from server)
-  struct sockaddr_in client_addr = {
-    .sin_family = AF_INET,
-    .sin_port = htons(port)
-  };
-
-  if(connect(client_sock, (struct sockaddr *)&client_addr, sizeof(struct sockaddr_in))){
-    perror("connect failed");
-    exit(2);
-  }
-
-  // struct hostent *server = gethostbyname("IP address returned from DIRSRV");
-  struct hostent *server = gethostbyname(ip_addr);
-  if (server == NULL) {
+  // Find the directory before connecting to it
+  struct sockaddr_in client_addr;
+  if(!resolve_address(ip_addr, port, &client_addr)){
     fprintf(stderr, "Unable to find host %s\n", ip_addr);
     exit(EXIT_FAILURE);
   }
-  bcopy((char *)server->h_addr, (char *)&client_addr.sin_addr.s_addr, server->h_length);
+
+  if(connect(client_sock, (struct sockaddr *)&client_addr, sizeof(struct sockaddr_in))){
+    close(client_sock);
+    return -1;
+  }
 
   // Duplicate the socket_fd so we can open it twice, once for input and once for output
   int client_sock_copy = dup(client_sock);
@@ -391,8 +1054,26 @@ candidate_list_t* connect_to_directory(int port, char* ip_addr, int command){
   fflush(output);
 
   if(command == CJOIN){
-    getline(&line, &linecap, input);
+    // The directory answers with our id and the address it sees us at, unless it's too busy
+    if(getline(&line, &linecap, input) <= 0){
+      free(line);
+      fclose(input);
+      fclose(output);
+      return -1;
+    }
+    if(strncmp(line, "RETRY ", 6) == 0){
+      int retry_ms = atoi(line + 6);
+      free(line);
+      fclose(input);
+      fclose(output);
+      return retry_ms > 0 ? retry_ms : DIRECTORY_BACKOFF_MS;
+    }
     directory_id = atoi(line);
+    char* seen_at = strstr(line, "#!");
+    if(seen_at != NULL){
+      seen_at[2 + strcspn(seen_at + 2, "#\n")] = '\0';
+      inet_pton(AF_INET, seen_at + 2, &my_host_addr);
+    }
 
     int id_len = 1;
     if(directory_id > 0){
@@ -419,7 +1100,8 @@ candidate_list_t* connect_to_directory(int port, char* ip_addr, int command){
     strcpy(reqstring + strlen(my_name) + strlen(my_ip_addr) + strlen(id) + 6, port);
     strcpy(reqstring + strlen(my_name) + strlen(my_ip_addr) + strlen(id) + strlen(port) + 6, "#!");
 
-    fprintf(output, "%s\n", reqstring);
+    // The directory lists peers in our zone first
+    fprintf(output, "%s%s#!\n", reqstring, my_zone);
     fflush(output);
 
   }else if(command == RQNEW){
@@ -428,95 +1110,529 @@ candidate_list_t* connect_to_directory(int port, char* ip_addr, int command){
   }else{
     fprintf(output, "%d\n", directory_id);
     fflush(output);
-    return NULL;
+    fclose(input);
+    fclose(output);
+    *candidates = NULL;
+    return 0;
   }
 
   candidate_list_t* root = NULL;
+  candidate_list_t** tail = &root;
 
+  bool first = true;
   while(getline(&line, &linecap, input) > 0){
-    char *parse_line = line;
-    candidate_t* new_candidate = (candidate_t*)malloc(sizeof(candidate_t));
+    // A busy directory answers a rejoin with nothing but when to come back
+    if(first && command == RQNEW && strncmp(line, "RETRY ", 6) == 0){
+      int retry_ms = atoi(line + 6);
+      free(line);
+      fclose(input);
+      fclose(output);
+      return retry_ms > 0 ? retry_ms : DIRECTORY_BACKOFF_MS;
+    }
+    first = false;
+    // Each line is name#!ip#!id#!port#!zone#!
+    line[strcspn(line, "\n")] = '\0';
+    char* name = strtok(line, "#!");
+    char* ip = strtok(NULL, "#!");
+    char* id = strtok(NULL, "#!");
+    char* port_num = strtok(NULL, "#!");
+    char* zone = strtok(NULL, "#!");
+    if(port_num == NULL || atoi(id) == directory_id){
+      continue;
+    }
 
-    new_candidate->name = strtok(parse_line, "#!");
-    new_candidate->ip_addr = strtok(NULL, "#!");
-    new_candidate->id = atoi(strtok(NULL, "#!"));
-    new_candidate->port_num = atoi(strtok(NULL, "#!"));
-    if(new_candidate->id != directory_id){
-      candidate_list_t* new_node = (candidate_list_t*)malloc(sizeof(candidate_list_t));;
-      new_node->candidate = new_candidate;
-      new_node->next = NULL;
-      if(root == NULL){
-        root = new_node;
-      } else {
-        root->next = new_node;
-      }
+    // The line buffer is reused, so the candidate keeps copies
+    candidate_t* new_candidate = (candidate_t*)malloc(sizeof(candidate_t));
+    new_candidate->name = strdup(name);
+    new_candidate->ip_addr = strdup(ip);
+    new_candidate->id = atoi(id);
+    new_candidate->port_num = atoi(port_num);
+    new_candidate->zone = strdup(zone == NULL ? "" : zone);
+    // Start any lookup now, so all the candidates' lookups overlap
+    resolver_prefetch(resolver, new_candidate->ip_addr);
+
+    candidate_list_t* new_node = (candidate_list_t*)malloc(sizeof(candidate_list_t));
+    new_node->candidate = new_candidate;
+    new_node->next = NULL;
+    *tail = new_node;
+    tail = &new_node->next;
+  }
+  free(line);
+  fclose(input);
+  fclose(output);
+
+  // Resolve everyone now so that probing and connecting don't wait on lookups
+  tail = &root;
+  while(*tail != NULL){
+    candidate_t* candidate = (*tail)->candidate;
+    if(resolve_address(candidate->ip_addr, candidate->port_num, &candidate->addr)){
+      tail = &(*tail)->next;
+    }else{
+      candidate_list_t* unknown = *tail;
+      *tail = unknown->next;
+      free_candidate(candidate);
+      free(unknown);
     }
   }
-  close(client_sock);
-  return root;
+  *candidates = root;
+  return 0;
 }
 
-void connect_to_parent(candidate_list_t* candidates, int client_sock){
-  int rand_index = random() % directory_id;
-  candidate_list_t *temp = candidates;
-  for(int i = 0; i < rand_index; i++){
-    candidates = candidates->next;
-  }
-  // Initialize socket address (with address to be specified from server)
-  struct sockaddr_in client_addr = {
-    .sin_family = AF_INET,
-    .sin_port = htons(candidates->candidate->port_num)
-  };
-
-  if(connect(client_sock, (struct sockaddr *)&client_addr, sizeof(struct sockaddr_in))){
-    while(temp->next != NULL){
-      if(temp->candidate->port_num == candidates->candidate->port_num){
-        candidate_list_t* delete = temp->next;
-        temp->candidate = temp->next->candidate;
-        temp->next = delete->next;
-        free(delete);
-      }else{
-        temp = temp->next;
+candidate_list_t* connect_to_directory(int port, char* ip_addr, int command){
+  // When everyone restarts at once, the directory turns joins away with a time to come back,
+  // or is too swamped to take the connection at all, in which case we back off on our own
+  int backoff_ms = DIRECTORY_BACKOFF_MS;
+  int unreachable_ms = 0;
+  while(true){
+    candidate_list_t* candidates = NULL;
+    int retry_ms = directory_request(port, ip_addr, command, &candidates);
+    if(retry_ms == 0){
+      return candidates;
+    }
+    if(retry_ms == -1){
+      if(unreachable_ms >= DIRECTORY_GIVE_UP_MS){
+        fprintf(stderr, "Unable to reach the directory at %s:%d\n", ip_addr, port);
+        exit(2);
       }
+      // Jittered, so peers refused together don't all come back together
+      retry_ms = backoff_ms / 2 + random() % (backoff_ms / 2 + 1);
+      unreachable_ms += retry_ms;
+      backoff_ms = backoff_ms * 2 < DIRECTORY_MAX_BACKOFF_MS ? backoff_ms * 2 : DIRECTORY_MAX_BACKOFF_MS;
+    }else{
+      // The directory already jittered its answer
+      if(retry_ms > DIRECTORY_MAX_RETRY_MS){
+        retry_ms = DIRECTORY_MAX_RETRY_MS;
+      }
+      char notice[MAX_MSG_LENGTH];
+      snprintf(notice, sizeof(notice), "The directory is busy; trying again in %d ms.", retry_ms);
+      ui_add_message(NULL, notice);
     }
-    connect_to_parent(temp, client_sock);
+    usleep(retry_ms * 1000);
   }
+}
 
-  // struct hostent *server = gethostbyname("IP address returned from DIRSRV");
-  struct hostent *server = gethostbyname(candidates->candidate->ip_addr);
-  if (server == NULL) {
-    fprintf(stderr, "Unable to find host %s\n", candidates->candidate->ip_addr);
-    exit(EXIT_FAILURE);
+// Fill in an address from a dotted quad or a host name. Returns false if it can't be found.
+bool resolve_address(char* host, int port, struct sockaddr_in* addr){
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  return resolver_lookup(resolver, host, &addr->sin_addr, RESOLVE_TIMEOUT_MS);
+}
+
+void free_candidate(candidate_t* candidate){
+  free(candidate->name);
+  free(candidate->ip_addr);
+  free(candidate->zone);
+  free(candidate);
+}
+
+void free_candidates(candidate_list_t* candidates){
+  while(candidates != NULL){
+    candidate_list_t* next = candidates->next;
+    free_candidate(candidates->candidate);
+    free(candidates);
+    candidates = next;
   }
-  bcopy((char *)server->h_addr, (char *)&client_addr.sin_addr.s_addr, server->h_length);
+}
 
-  // create parent struct
-  parent.c_name = candidates->candidate->name;
-  parent.sockfd = client_sock;
-  pthread_mutex_init(&parent.m, NULL);
-  // Duplicate the socket_fd so we can open it twice, once for input and once for output
-  int client_sock_copy = dup(client_sock);
-  if(client_sock_copy == -1) {
-    perror("dup failed 2");
-    exit(EXIT_FAILURE);
+// Race connections to some would-be parents, best first. Returns the winner's link, or NULL.
+link_t* dial_parent(struct sockaddr_in* addrs, int count, int* winner){
+  uint32_t agreed;
+  int parent_sock = race_connect(addrs, count, my_caps, &agreed, winner);
+  if(parent_sock == -1){
+    return NULL;
   }
-  FILE* parent_input = fdopen(client_sock, "r");
-  FILE* parent_output = fdopen(client_sock_copy, "w");
-  // Check for errors
-  if(parent_input == NULL || parent_output == NULL) {
-    perror("fdopen failed");
-    exit(EXIT_FAILURE);
+  // The HELLOs were traded during the race
+  link_t* link = link_open(parent_sock, "parent");
+  link->caps = agreed;
+
+  // A parent on this host is better reached through shared memory
+  struct in_addr host = addrs[*winner].sin_addr;
+  bool loopback = (ntohl(host.s_addr) >> 24) == 127;
+  if((link->caps & LINK_CAP_SHM) && (loopback || host.s_addr == my_host_addr.s_addr)){
+    char shm_name[64];
+    snprintf(shm_name, sizeof(shm_name), "chat-shm-%d", ntohs(addrs[*winner].sin_port));
+    link_offer_shm(link, shm_name);
+  }
+  return link;
+}
+
+// Make a connected link our parent, hanging up on the one it replaces if asked to
+void adopt_parent(link_t* link, struct sockaddr_in* addr, bool hang_up){
+  link->shard = pipeline_assign(pipeline);
+  pthread_rwlock_wrlock(&links_lock);
+  link_t* old = parent;
+  parent = link;
+  parent_addr = *addr;
+  if(old != NULL && hang_up){
+    // Its link thread sees the hangup and frees it
+    shutdown(old->sockfd, SHUT_RDWR);
   }
-  parent.input = parent_input;
-  parent.output = parent_output;
+  pthread_rwlock_unlock(&links_lock);
+
+  pthread_mutex_lock(&tree_lock);
+  has_place = false;
+  pthread_mutex_unlock(&tree_lock);
+
+  // A new parent knows nothing of our subtree's channels yet
+  advertise_interest(true);
+
   // run parent thread
   thread_arg_t* parent_args = malloc(sizeof(thread_arg_t));
-  parent_args->input = parent_input;
-  parent_args->client_name = my_name;
-  parent_args->socket_fd = client_sock;
+  parent_args->socket_fd = link->sockfd;
+  parent_args->link = link;
+  parent_args->is_parent = true;
   pthread_t parent_thread;
-  if(pthread_create(&parent_thread, NULL, parent_thread_fn, parent_args)) {
+  if(pthread_create(&parent_thread, NULL, link_thread_fn, parent_args)) {
     perror("pthread_create failed");
     exit(EXIT_FAILURE);
   }
+  pthread_detach(parent_thread);
+}
+
+// Shuffle part of the candidate pool, so joiners don't all pile onto the same peers
+void shuffle_candidates(candidate_t** pool, int count){
+  for(int i = count - 1; i > 0; i--){
+    int j = random() % (i + 1);
+    candidate_t* swap = pool[i];
+    pool[i] = pool[j];
+    pool[j] = swap;
+  }
+}
+
+void connect_to_parent(candidate_list_t* candidates){
+  // Peers in our zone go first, each group in random order
+  int count = 0;
+  for(candidate_list_t* temp = candidates; temp != NULL; temp = temp->next){
+    count++;
+  }
+  candidate_t** pool = malloc(sizeof(candidate_t*) * (count + 1));
+  int local = 0;
+  for(candidate_list_t* temp = candidates; temp != NULL; temp = temp->next){
+    if(strcmp(temp->candidate->zone, my_zone) == 0){
+      pool[local++] = temp->candidate;
+    }
+  }
+  int filled = local;
+  for(candidate_list_t* temp = candidates; temp != NULL; temp = temp->next){
+    if(strcmp(temp->candidate->zone, my_zone) != 0){
+      pool[filled++] = temp->candidate;
+    }
+  }
+  shuffle_candidates(pool, local);
+  shuffle_candidates(pool + local, count - local);
+
+  // Measure a few of them at once
+  int sample = count < PROBE_SAMPLE ? count : PROBE_SAMPLE;
+  probe_t probes[PROBE_SAMPLE];
+  for(int i = 0; i < sample; i++){
+    probes[i].addr = pool[i]->addr;
+  }
+  probe_rtt(probes, sample, PROBE_TIMEOUT_MS);
+
+  // Try the nearest that has room, then the ones we didn't measure, then the ones that didn't answer
+  candidate_t** order = malloc(sizeof(candidate_t*) * (count + 1));
+  int64_t rtt[PROBE_SAMPLE];
+  int ranked = 0;
+  for(int i = 0; i < sample; i++){
+    if(probes[i].rtt_us < 0 || probes[i].spare <= 0){
+      continue;
+    }
+    int j = ranked++;
+    while(j > 0 && probes[i].rtt_us < rtt[j-1]){
+      order[j] = order[j-1];
+      rtt[j] = rtt[j-1];
+      j--;
+    }
+    order[j] = pool[i];
+    rtt[j] = probes[i].rtt_us;
+  }
+  for(int i = sample; i < count; i++){
+    order[ranked++] = pool[i];
+  }
+  for(int i = 0; i < sample; i++){
+    if(probes[i].rtt_us < 0){
+      order[ranked++] = pool[i];
+    }
+  }
+
+  // Race them in that order; the first to answer becomes our parent
+  struct sockaddr_in* addrs = malloc(sizeof(struct sockaddr_in) * (ranked + 1));
+  for(int i = 0; i < ranked; i++){
+    addrs[i] = order[i]->addr;
+  }
+  int winner;
+  link_t* link = dial_parent(addrs, ranked, &winner);
+  if(link != NULL){
+    adopt_parent(link, &addrs[winner], true);
+  }else{
+    // We'll ask the directory again the next time we have something to send
+    ui_add_message(NULL, "Unable to reach a parent; will try again.");
+  }
+  free(addrs);
+  free(order);
+  free(pool);
+}
+
+// Tell our parent about our subtree and our children where they sit
+void share_tree_state(){
+  pthread_mutex_lock(&tree_lock);
+  tree_place_t above = parent_place;
+  bool placed = has_place;
+  pthread_mutex_unlock(&tree_lock);
+
+  pthread_rwlock_rdlock(&links_lock);
+  tree_summary_t summary = { 1, 0, client_count < max_children ? max_children - client_count : 0, my_port };
+  uint32_t tallest = TREE_NO_PROMOTE;
+  int tallest_height = -1;
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    link_t* child = temp->c;
+    if(child->subtree_size == 0){
+      // Hasn't reported yet; it's at least there
+      summary.size++;
+      continue;
+    }
+    summary.size += child->subtree_size;
+    if(child->subtree_height + 1 > summary.height){
+      summary.height = child->subtree_height + 1;
+    }
+    if(child->subtree_height > tallest_height){
+      tallest_height = child->subtree_height;
+      tallest = child->peer_id;
+    }
+  }
+
+  tree_place_t place;
+  memset(&place, 0, sizeof(place));
+  place.depth = parent != NULL && placed ? above.depth + 1 : 0;
+  place.spare = client_count < max_children ? max_children - client_count : 0;
+  place.promote = TREE_NO_PROMOTE;
+  if(parent != NULL && placed){
+    place.grandparent = parent_addr;
+    place.grandparent_spare = above.spare;
+    // Our parent has room, so our tallest subtree can move up a level
+    if(above.spare > 0){
+      place.promote = tallest;
+    }
+  }
+
+  link_batch_begin();
+  frame_t* frame = tree_place_frame(directory_id, &place);
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    link_send(temp->c, frame);
+  }
+  frame_free(frame);
+  if(parent != NULL){
+    frame = tree_summary_frame(directory_id, &summary);
+    link_send(parent, frame);
+    frame_free(frame);
+  }
+  link_batch_end();
+  pthread_rwlock_unlock(&links_lock);
+}
+
+// Move up to our grandparent if our parent invited us to and it's been a while
+void* rebalance_thread_fn(void* p){
+  time_t last_move = 0;
+  while(true){
+    // Jitter keeps neighbors from acting in lockstep
+    usleep((TREE_INTERVAL_MS / 2 + random() % TREE_INTERVAL_MS) * 1000);
+    share_tree_state();
+
+    pthread_mutex_lock(&tree_lock);
+    tree_place_t place = parent_place;
+    bool invited = has_place && place.promote == (uint32_t)directory_id &&
+                   place.grandparent.sin_port != 0 && place.grandparent_spare > 0;
+    pthread_mutex_unlock(&tree_lock);
+    if(!invited || time(NULL) - last_move < TREE_MOVE_COOLDOWN){
+      continue;
+    }
+
+    pthread_rwlock_rdlock(&links_lock);
+    link_t* old = parent != NULL ? link_retain(parent) : NULL;
+    pthread_rwlock_unlock(&links_lock);
+    if(old == NULL){
+      continue;
+    }
+
+    // Only let go of our parent once the grandparent has taken us, and not before we've had
+    // what it queued for us, as it was sent to us alone
+    int winner;
+    link_t* link = dial_parent(&place.grandparent, 1, &winner);
+    if(link != NULL){
+      last_move = time(NULL);
+      adopt_parent(link, &place.grandparent, false);
+      link_flush(old, LEAVE_FLUSH_MS);
+      send_handoff(old, &place.grandparent, 0);
+    }
+    link_release(old);
+  }
+  return NULL;
+}
+
+// Show where we sit in the tree
+void show_tree(){
+  pthread_mutex_lock(&tree_lock);
+  int depth = parent != NULL && has_place ? parent_place.depth + 1 : 0;
+  pthread_mutex_unlock(&tree_lock);
+
+  pthread_rwlock_rdlock(&links_lock);
+  uint32_t size = 1;
+  int height = 0;
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    size += temp->c->subtree_size == 0 ? 1 : temp->c->subtree_size;
+    if(temp->c->subtree_height + 1 > height){
+      height = temp->c->subtree_height + 1;
+    }
+  }
+  int children = client_count;
+  pthread_rwlock_unlock(&links_lock);
+
+  char summary[MAX_MSG_LENGTH];
+  snprintf(summary, sizeof(summary), "depth %d, %d children, subtree of %u peers and height %d",
+           depth, children, size, height);
+  ui_add_message(NULL, summary);
+}
+
+// Wait for the pipeline to empty, then for every neighbor's queue to be written
+void flush_outbound(){
+  pipeline_drain(pipeline, LEAVE_FLUSH_MS);
+
+  // The links are waited on without the lock, so relaying isn't held up meanwhile
+  pthread_rwlock_rdlock(&links_lock);
+  int count = parent != NULL ? 1 : 0;
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    count++;
+  }
+  link_t** links = malloc(sizeof(link_t*) * (count + 1));
+  int n = 0;
+  if(parent != NULL){
+    links[n++] = link_retain(parent);
+  }
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    links[n++] = link_retain(temp->c);
+  }
+  pthread_rwlock_unlock(&links_lock);
+
+  for(int i = 0; i < n; i++){
+    link_flush(links[i], LEAVE_FLUSH_MS);
+    link_release(links[i]);
+  }
+  free(links);
+}
+
+// Find where other peers can reach a child, if it has told us its port
+bool child_address(link_t* child, struct sockaddr_in* addr){
+  socklen_t length = sizeof(struct sockaddr_in);
+  if(child->peer_port == 0 || getpeername(child->sockfd, (struct sockaddr*)addr, &length) != 0){
+    return false;
+  }
+  // A child on our host may have come in over loopback, which only peers on this host can use
+  if((ntohl(addr->sin_addr.s_addr) >> 24) == 127 && my_host_addr.s_addr != 0){
+    addr->sin_addr = my_host_addr;
+  }
+  addr->sin_port = htons(child->peer_port);
+  return true;
+}
+
+void send_handoff(link_t* link, struct sockaddr_in* to, uint16_t extra){
+  frame_t* frame = tree_handoff_frame(directory_id, to, extra);
+  link_send(link, frame);
+  frame_free(frame);
+}
+
+// Tell each child where to go now that we're leaving. See tree.h.
+void hand_off_children(){
+  pthread_mutex_lock(&tree_lock);
+  int parent_room = parent != NULL && has_place ? parent_place.spare : 0;
+  pthread_mutex_unlock(&tree_lock);
+
+  pthread_rwlock_rdlock(&links_lock);
+  // The child with the most room takes our place, and as many of its siblings as it can
+  link_t* heir = NULL;
+  int children = 0;
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    link_t* child = temp->c;
+    children++;
+    if(heir == NULL || child->peer_spare > heir->peer_spare ||
+       (child->peer_spare == heir->peer_spare && child->subtree_height > heir->subtree_height)){
+      heir = child;
+    }
+  }
+  if(heir == NULL){
+    pthread_rwlock_unlock(&links_lock);
+    return;
+  }
+
+  // Siblings go to the heir while it has room, then to our parent while it does
+  struct sockaddr_in heir_addr;
+  bool reachable = child_address(heir, &heir_addr);
+  // Without a parent or the root's place to give it, the heir isn't told to stay, so it can't take more
+  bool root = is_root;
+  bool heir_stays = parent != NULL || root;
+  int heir_room = heir->peer_spare;
+  link_t** overflow = malloc(sizeof(link_t*) * children);
+  int overflow_count = 0;
+  link_batch_begin();
+  for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+    link_t* child = temp->c;
+    if(child == heir){
+      continue;
+    }
+    if(reachable && heir_room > 0){
+      send_handoff(child, &heir_addr, 0);
+      heir_room--;
+    }else if(parent_room > 0){
+      send_handoff(child, &parent_addr, 0);
+      parent_room--;
+    }else if(reachable && heir_stays){
+      // Nowhere has room, so the heir takes it over its limit rather than leave it to the directory
+      overflow[overflow_count++] = child;
+    }
+  }
+  if(parent != NULL){
+    // Our parent gives our place to the heir
+    send_handoff(parent, NULL, 0);
+    send_handoff(heir, &parent_addr, overflow_count);
+  }else if(root){
+    send_handoff(heir, NULL, overflow_count);
+  }
+  // Sent after the heir's, so it knows to expect them
+  for(int i = 0; i < overflow_count; i++){
+    send_handoff(overflow[i], &heir_addr, 0);
+  }
+  link_batch_end();
+  pthread_rwlock_unlock(&links_lock);
+  free(overflow);
+}
+
+// Leave the tree without losing anything: send what we owe, hand our children on,
+// and keep relaying for them until they've moved
+void leave_tree(int server_sock){
+  // No one new joins below us from here on
+  shutdown(server_sock, SHUT_RDWR);
+
+  // Handoffs are control frames and jump the queues, so what's queued goes first
+  flush_outbound();
+  hand_off_children();
+
+  // Each child answers with a handoff of its own once it has reattached. Until then we keep
+  // relaying for it, since its siblings may still only hear it through us.
+  for(int waited = 0; waited < LEAVE_HANDOFF_MS; waited += LEAVE_POLL_MS){
+    pthread_rwlock_rdlock(&links_lock);
+    bool moved = true;
+    for(client_list_t* temp = c_list; temp != NULL; temp = temp->next){
+      if(!temp->c->leaving){
+        moved = false;
+      }
+    }
+    pthread_rwlock_unlock(&links_lock);
+    if(moved){
+      break;
+    }
+    usleep(LEAVE_POLL_MS * 1000);
+  }
+
+  // What they sent on their way out still has to reach our parent and each other
+  flush_outbound();
 }
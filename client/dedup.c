@@ -0,0 +1,75 @@
+#include "dedup.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+dedup_t* dedup_create() {
+  return calloc(1, sizeof(dedup_t));
+}
+
+// Find an origin's window, adding a fresh one if we've never heard from it
+dedup_origin_t* dedup_find(dedup_t* dedup, uint32_t origin, bool* created) {
+  dedup_origin_t** bucket = &dedup->buckets[origin % DEDUP_BUCKETS];
+  for(dedup_origin_t* o = *bucket; o != NULL; o = o->next) {
+    if(o->origin == origin) {
+      *created = false;
+      return o;
+    }
+  }
+  dedup_origin_t* o = calloc(1, sizeof(dedup_origin_t));
+  o->origin = origin;
+  o->next = *bucket;
+  *bucket = o;
+  *created = true;
+  return o;
+}
+
+void dedup_set(dedup_origin_t* o, uint32_t seq) {
+  o->seen[(seq % DEDUP_WINDOW) / 64] |= (uint64_t)1 << (seq % 64);
+}
+
+bool dedup_first(dedup_t* dedup, uint32_t origin, uint32_t seq) {
+  bool created;
+  dedup_origin_t* o = dedup_find(dedup, origin, &created);
+  if(created || (seq < o->highest && o->highest - seq >= DEDUP_WINDOW)) {
+    // New to us, or starting over
+    memset(o->seen, 0, sizeof(o->seen));
+    o->highest = seq;
+    dedup_set(o, seq);
+    return true;
+  }
+
+  if(seq > o->highest) {
+    // Slide the window up, forgetting the numbers that fall out of it
+    if(seq - o->highest >= DEDUP_WINDOW) {
+      memset(o->seen, 0, sizeof(o->seen));
+    } else {
+      for(uint32_t s = o->highest + 1; s != seq; s++) {
+        o->seen[(s % DEDUP_WINDOW) / 64] &= ~((uint64_t)1 << (s % 64));
+      }
+    }
+    o->highest = seq;
+    dedup_set(o, seq);
+    return true;
+  }
+
+  uint64_t bit = (uint64_t)1 << (seq % 64);
+  uint64_t* word = &o->seen[(seq % DEDUP_WINDOW) / 64];
+  if(*word & bit) {
+    return false;
+  }
+  *word |= bit;
+  return true;
+}
+
+void dedup_destroy(dedup_t* dedup) {
+  for(int b = 0; b < DEDUP_BUCKETS; b++) {
+    dedup_origin_t* o = dedup->buckets[b];
+    while(o != NULL) {
+      dedup_origin_t* next = o->next;
+      free(o);
+      o = next;
+    }
+  }
+  free(dedup);
+}
@@ -0,0 +1,52 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Origins are spread over this many hash chains
+#define DEDUP_BUCKETS 256
+// How many of each origin's most recent sequence numbers are remembered
+#define DEDUP_WINDOW 1024
+
+/**
+ * Every frame a peer creates carries its id and the next of its sequence
+ * numbers, so (origin, seq) names a frame across the whole tree. A frame
+ * arrives twice only when the tree reshapes under it, and then close to
+ * the first copy, so each origin only needs a window of recent numbers: the
+ * highest seen, and a bit for each of the DEDUP_WINDOW below it.
+ *
+ * A number that falls behind the window is taken as the origin starting
+ * over (e.g. its id was reused after the directory restarted), not as a
+ * duplicate. Delivering a very late copy twice is better than dropping
+ * every message from a new peer.
+ */
+typedef struct dedup_origin {
+  uint32_t origin;
+  uint32_t highest;
+  uint64_t seen[DEDUP_WINDOW / 64];
+  struct dedup_origin* next;
+} dedup_origin_t;
+
+typedef struct dedup {
+  dedup_origin_t* buckets[DEDUP_BUCKETS];
+} dedup_t;
+
+/**
+ * Create an empty table. Not thread-safe; one thread should own it.
+ */
+dedup_t* dedup_create();
+
+/**
+ * Note a frame's (origin, seq).
+ *
+ * \returns true the first time a frame is seen, false for a duplicate.
+ */
+bool dedup_first(dedup_t* dedup, uint32_t origin, uint32_t seq);
+
+/**
+ * Free the table.
+ */
+void dedup_destroy(dedup_t* dedup);
+
+#endif
@@ -0,0 +1,280 @@
+#include "frame.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+frame_t* frame_create(uint8_t type, uint32_t origin, uint32_t seq, char* payload, uint32_t length) {
+  frame_t* frame = malloc(sizeof(frame_t));
+  frame->type = type;
+  frame->flags = 0;
+  frame->origin = origin;
+  frame->seq = seq;
+  frame->channel = 0;
+  frame->order = 0;
+  frame->length = length;
+  frame->payload = malloc(length + 1);
+  memcpy(frame->payload, payload, length);
+  frame->payload[length] = '\0';
+  atomic_init(&frame->refs, 1);
+  frame->on_release = NULL;
+  frame->release_arg = NULL;
+  return frame;
+}
+
+frame_t* frame_build(uint8_t type, uint32_t origin, uint32_t seq, char* payload, uint32_t length, bool compress) {
+  if(compress && length >= FRAME_COMPRESS_MIN) {
+    // Keep the compressed form only if it actually saves space
+    char* packed = malloc(4 + LZ_BOUND(length));
+    size_t packed_length = lz_compress(payload, length, packed + 4, LZ_BOUND(length));
+    if(packed_length > 0 && packed_length + 4 < length) {
+      uint32_t original = htonl(length);
+      memcpy(packed, &original, 4);
+      frame_t* frame = frame_create(type, origin, seq, packed, packed_length + 4);
+      frame->flags |= FRAME_COMPRESSED;
+      free(packed);
+      return frame;
+    }
+    free(packed);
+  }
+  return frame_create(type, origin, seq, payload, length);
+}
+
+frame_t* frame_message(uint32_t origin, uint32_t seq, char* username, char* message, bool compress) {
+  size_t name_length = strlen(username);
+  size_t message_length = strlen(message);
+  uint32_t length = name_length + 2 + message_length;
+
+  char* text = malloc(length + 1);
+  strcpy(text, username);
+  strcpy(text + name_length, "#!");
+  strcpy(text + name_length + 2, message);
+
+  frame_t* frame = frame_build(FRAME_MSG, origin, seq, text, length, compress);
+  free(text);
+  return frame;
+}
+
+void frame_add_dependencies(frame_t* frame, frame_dependency_t* deps, int count) {
+  uint32_t size = 2 + count * FRAME_DEPENDENCY_SIZE;
+  char* payload = malloc(size + frame->length + 1);
+  uint16_t dep_count = htons(count);
+  memcpy(payload, &dep_count, 2);
+  for(int i = 0; i < count; i++) {
+    uint32_t dep_origin = htonl(deps[i].origin);
+    uint16_t dep_order = htons(deps[i].order);
+    memcpy(payload + 2 + i * FRAME_DEPENDENCY_SIZE, &dep_origin, 4);
+    memcpy(payload + 6 + i * FRAME_DEPENDENCY_SIZE, &dep_order, 2);
+  }
+  memcpy(payload + size, frame->payload, frame->length + 1);
+  free(frame->payload);
+  frame->payload = payload;
+  frame->length += size;
+  frame->flags |= FRAME_DEPENDS;
+}
+
+// How many bytes of dependencies start the payload, or -1 if they don't fit in it
+int64_t frame_dependencies_size(frame_t* frame) {
+  if(!(frame->flags & FRAME_DEPENDS)) {
+    return 0;
+  }
+  if(frame->length < 2) {
+    return -1;
+  }
+  uint16_t count;
+  memcpy(&count, frame->payload, 2);
+  count = ntohs(count);
+  uint32_t size = 2 + count * FRAME_DEPENDENCY_SIZE;
+  if(count > FRAME_MAX_DEPENDENCIES || size > frame->length) {
+    return -1;
+  }
+  return size;
+}
+
+int frame_dependencies(frame_t* frame, frame_dependency_t* deps) {
+  int64_t size = frame_dependencies_size(frame);
+  if(size <= 0) {
+    return 0;
+  }
+  int count = (size - 2) / FRAME_DEPENDENCY_SIZE;
+  for(int i = 0; i < count; i++) {
+    uint32_t dep_origin;
+    uint16_t dep_order;
+    memcpy(&dep_origin, frame->payload + 2 + i * FRAME_DEPENDENCY_SIZE, 4);
+    memcpy(&dep_order, frame->payload + 6 + i * FRAME_DEPENDENCY_SIZE, 2);
+    deps[i].origin = ntohl(dep_origin);
+    deps[i].order = ntohs(dep_order);
+  }
+  return count;
+}
+
+int frame_payload(frame_t* frame, char** plain, uint32_t* length) {
+  // Dependencies come first, outside any compression
+  int64_t skip = frame_dependencies_size(frame);
+  if(skip == -1) {
+    return -1;
+  }
+  char* payload = frame->payload + skip;
+  uint32_t payload_length = frame->length - skip;
+  if(!(frame->flags & FRAME_COMPRESSED)) {
+    *plain = payload;
+    if(payload != frame->payload) {
+      // Callers free anything that isn't frame->payload, so a payload after dependencies is copied
+      *plain = malloc(payload_length + 1);
+      memcpy(*plain, payload, payload_length + 1);
+    }
+    *length = payload_length;
+    return 0;
+  }
+  if(payload_length < 4) {
+    return -1;
+  }
+  uint32_t original;
+  memcpy(&original, payload, 4);
+  original = ntohl(original);
+  if(original > MAX_FRAME_LENGTH) {
+    return -1;
+  }
+  char* buffer = malloc(original + 1);
+  if(lz_decompress(payload + 4, payload_length - 4, buffer, original) == -1) {
+    free(buffer);
+    return -1;
+  }
+  buffer[original] = '\0';
+  *plain = buffer;
+  *length = original;
+  return 0;
+}
+
+int frame_open_message(frame_t* frame, char** username, char** message) {
+  char* plain;
+  uint32_t length;
+  if(frame_payload(frame, &plain, &length) == -1) {
+    return -1;
+  }
+
+  // The name ends at the first separator; the message may contain anything
+  char* separator = strstr(plain, "#!");
+  if(separator == NULL) {
+    *username = strdup("");
+    *message = strndup(plain, length);
+  } else {
+    *username = strndup(plain, separator - plain);
+    *message = strndup(separator + 2, length - (separator + 2 - plain));
+  }
+  if(plain != frame->payload) {
+    free(plain);
+  }
+  return 0;
+}
+
+frame_t* frame_decompressed(frame_t* frame) {
+  char* plain;
+  uint32_t length;
+  if(frame_payload(frame, &plain, &length) == -1) {
+    return NULL;
+  }
+  frame_t* copy = frame_create(frame->type, frame->origin, frame->seq, plain, length);
+  copy->flags = frame->flags & ~(FRAME_COMPRESSED | FRAME_DEPENDS);
+  copy->channel = frame->channel;
+  copy->order = frame->order;
+  if(plain != frame->payload) {
+    free(plain);
+  }
+  frame_dependency_t deps[FRAME_MAX_DEPENDENCIES];
+  int count = frame_dependencies(frame, deps);
+  if(count > 0) {
+    frame_add_dependencies(copy, deps, count);
+  }
+  return copy;
+}
+
+void frame_encode_header(frame_t* frame, unsigned char* header) {
+  uint32_t origin = htonl(frame->origin);
+  uint32_t seq = htonl(frame->seq);
+  uint32_t channel = htonl(frame->channel);
+  uint32_t length = htonl(frame->length);
+  uint16_t order = htons(frame->order);
+  header[0] = frame->type;
+  header[1] = frame->flags;
+  memcpy(header + 2, &order, 2);
+  memcpy(header + 4, &origin, 4);
+  memcpy(header + 8, &seq, 4);
+  memcpy(header + 12, &channel, 4);
+  memcpy(header + 16, &length, 4);
+}
+
+frame_t* frame_decode_header(unsigned char* header) {
+  uint32_t origin, seq, channel, length;
+  uint16_t order;
+  memcpy(&order, header + 2, 2);
+  memcpy(&origin, header + 4, 4);
+  memcpy(&seq, header + 8, 4);
+  memcpy(&channel, header + 12, 4);
+  memcpy(&length, header + 16, 4);
+  length = ntohl(length);
+  if(length > MAX_FRAME_LENGTH) {
+    return NULL;
+  }
+
+  frame_t* frame = malloc(sizeof(frame_t));
+  frame->type = header[0];
+  frame->flags = header[1];
+  frame->origin = ntohl(origin);
+  frame->seq = ntohl(seq);
+  frame->channel = ntohl(channel);
+  frame->order = ntohs(order);
+  frame->length = length;
+  frame->payload = malloc(length + 1);
+  frame->payload[length] = '\0';
+  atomic_init(&frame->refs, 1);
+  frame->on_release = NULL;
+  frame->release_arg = NULL;
+  return frame;
+}
+
+int frame_write(FILE* output, frame_t* frame) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  frame_encode_header(frame, header);
+  if(fwrite(header, FRAME_HEADER_SIZE, 1, output) != 1) {
+    return -1;
+  }
+  if(frame->length > 0 && fwrite(frame->payload, frame->length, 1, output) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+frame_t* frame_read(FILE* input) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  if(fread(header, FRAME_HEADER_SIZE, 1, input) != 1) {
+    return NULL;
+  }
+  frame_t* frame = frame_decode_header(header);
+  if(frame == NULL) {
+    return NULL;
+  }
+  if(frame->length > 0 && fread(frame->payload, frame->length, 1, input) != 1) {
+    frame_free(frame);
+    return NULL;
+  }
+  return frame;
+}
+
+frame_t* frame_retain(frame_t* frame) {
+  atomic_fetch_add(&frame->refs, 1);
+  return frame;
+}
+
+void frame_free(frame_t* frame) {
+  if(frame == NULL || atomic_fetch_sub(&frame->refs, 1) != 1) {
+    return;
+  }
+  if(frame->on_release != NULL) {
+    frame->on_release(frame->release_arg, frame->type);
+  }
+  free(frame->payload);
+  free(frame);
+}
@@ -0,0 +1,186 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Everything peers send each other is a frame: a fixed 20-byte header in
+ * network byte order followed by a payload.
+ *
+ *   type (1) | flags (1) | order (2) | origin (4) | seq (4) | channel (4) | length (4)
+ *
+ * Origin is the directory id of the peer that created the frame and seq
+ * counts the frames it has created, so together they name a frame anywhere
+ * in the tree. Channel is the hash of the channel a message was posted to,
+ * or 0 for everyone; it sits outside the payload so relays can route on it
+ * without decompressing anything. Order counts an origin's chat messages on
+ * one channel, so receivers can put them back in order; see order.h.
+ */
+#define FRAME_HEADER_SIZE 20
+// Frames longer than this are treated as a broken stream
+#define MAX_FRAME_LENGTH (1 << 20)
+
+// Frame types
+#define FRAME_HELLO 1   // Link handshake. Payload is the sender's capabilities.
+#define FRAME_MSG 2     // A chat message. Payload is "username#!message".
+#define FRAME_XFER 3    // Start of a chunked transfer. See transfer.h.
+#define FRAME_CHUNK 4   // One chunk of a transfer. See transfer.h.
+#define FRAME_SUB 5     // The channels a subtree wants. Payload is a bloom_t.
+#define FRAME_PING 6    // Sent instead of HELLO to measure a would-be parent
+#define FRAME_PONG 7    // Answer to a PING. Payload is the children it has room for.
+#define FRAME_PLACE 8   // Parent to child: where the child sits. See tree.h.
+#define FRAME_SUMMARY 9 // Child to parent: the size and height of its subtree. See tree.h.
+#define FRAME_CREDIT 10 // Flow-control credit returned to a sender. See link.h.
+#define FRAME_SHM 11    // The sender's frames continue in shared memory. Payload is a token.
+#define FRAME_HANDOFF 12 // Parent to child: the parent is leaving; where to go. See tree.h.
+
+// Frame flags
+#define FRAME_COMPRESSED 0x01   // Payload is a 4-byte original length and an lz block
+#define FRAME_ORDERED 0x02      // The order field is set
+#define FRAME_DEPENDS 0x04      // Payload starts with dependencies, ahead of any compression
+
+// Dependencies name messages that must be shown first: count (2) | count x (origin (4) | order (2))
+#define FRAME_MAX_DEPENDENCIES 8
+#define FRAME_DEPENDENCY_SIZE 6
+
+// A message to show first: one origin's message on the same channel
+typedef struct frame_dependency {
+  uint32_t origin;
+  uint16_t order;
+} frame_dependency_t;
+
+// Payloads shorter than this aren't worth compressing
+#define FRAME_COMPRESS_MIN 24
+
+typedef struct frame {
+  uint8_t type;
+  uint8_t flags;
+  uint32_t origin;
+  uint32_t seq;
+  uint32_t channel;
+  uint16_t order;
+  uint32_t length;
+  char* payload;
+  // A frame queued on several links is shared, and freed with its last reference
+  atomic_int refs;
+  // Called just before the frame is freed, e.g. to return flow-control credit
+  void (*on_release)(void* arg, uint8_t type);
+  void* release_arg;
+} frame_t;
+
+/**
+ * Allocate a frame with a copy of a payload.
+ *
+ * \param payload  The payload bytes. This function does *not* take ownership
+ *                 of this memory.
+ */
+frame_t* frame_create(uint8_t type, uint32_t origin, uint32_t seq, char* payload, uint32_t length);
+
+/**
+ * Build a frame around a payload, compressing it if that makes it smaller.
+ *
+ * \param payload   The payload bytes. Not owned by this function.
+ * \param compress  Whether compression may be used.
+ */
+frame_t* frame_build(uint8_t type, uint32_t origin, uint32_t seq, char* payload, uint32_t length, bool compress);
+
+/**
+ * Build a chat message frame, compressing it if that makes it smaller.
+ *
+ * \param username  The sender's name. Not owned by this function.
+ * \param message   The message text. Not owned by this function.
+ * \param compress  Whether compression may be used.
+ */
+frame_t* frame_message(uint32_t origin, uint32_t seq, char* username, char* message, bool compress);
+
+/**
+ * Make a message depend on others, which receivers that keep causal order
+ * show first. The frame must not have been sent yet.
+ *
+ * \param deps   The messages depended on, on the same channel as this one.
+ *               Not owned by this function.
+ * \param count  How many, at most FRAME_MAX_DEPENDENCIES.
+ */
+void frame_add_dependencies(frame_t* frame, frame_dependency_t* deps, int count);
+
+/**
+ * Get the messages a frame depends on.
+ *
+ * \param deps  Receives up to FRAME_MAX_DEPENDENCIES of them.
+ *
+ * \returns How many, or 0 if it has none or they are malformed.
+ */
+int frame_dependencies(frame_t* frame, frame_dependency_t* deps);
+
+/**
+ * Get a frame's payload in plain form, without any dependency.
+ *
+ * \param plain   Receives the payload. If it isn't frame->payload it was
+ *                allocated for the caller, who must free it.
+ * \param length  Receives the payload length.
+ *
+ * \returns 0 on success, or -1 if a compressed payload is malformed.
+ */
+int frame_payload(frame_t* frame, char** plain, uint32_t* length);
+
+/**
+ * Unpack a chat message frame, decompressing it if needed.
+ *
+ * \param username  Receives a newly allocated copy of the sender's name.
+ * \param message   Receives a newly allocated copy of the message text.
+ *
+ * \returns 0 on success, or -1 if the payload is malformed.
+ */
+int frame_open_message(frame_t* frame, char** username, char** message);
+
+/**
+ * Make an uncompressed copy of a frame, for a peer that can't decompress.
+ *
+ * \returns The copy, or NULL if the payload is malformed.
+ */
+frame_t* frame_decompressed(frame_t* frame);
+
+/**
+ * Write a frame's header into FRAME_HEADER_SIZE bytes, for transports that
+ * don't use streams.
+ */
+void frame_encode_header(frame_t* frame, unsigned char* header);
+
+/**
+ * Allocate a frame from a received header. Its payload is allocated with
+ * room for frame->length bytes, which the caller fills in.
+ *
+ * \returns The frame, or NULL if the header is malformed.
+ */
+frame_t* frame_decode_header(unsigned char* header);
+
+/**
+ * Write a frame to a stream. The stream is not flushed.
+ *
+ * \returns 0 on success, -1 on error.
+ */
+int frame_write(FILE* output, frame_t* frame);
+
+/**
+ * Read the next frame from a stream into a newly allocated frame.
+ *
+ * \returns The frame, or NULL at end of stream or on a malformed header.
+ */
+frame_t* frame_read(FILE* input);
+
+/**
+ * Take another reference to a frame. Each reference is dropped with frame_free.
+ *
+ * \returns The frame.
+ */
+frame_t* frame_retain(frame_t* frame);
+
+/**
+ * Drop a reference to a frame, freeing it and its payload with the last one.
+ */
+void frame_free(frame_t* frame);
+
+#endif
@@ -0,0 +1,263 @@
+#include "history.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Address space reserved for each file. Only the pages that are touched use memory.
+#define HISTORY_LOG_RESERVE (1ULL << 36)
+#define HISTORY_INDEX_RESERVE (1ULL << 32)
+// Files grow by at least this much at a time so ftruncate stays off the fast path
+#define HISTORY_LOG_GROW (1 << 20)
+#define HISTORY_INDEX_GROW (1 << 16)
+
+// Slots at the start of the index file before the message offsets
+#define INDEX_COUNT 0
+#define INDEX_LOG_SIZE 1
+#define INDEX_HEADER 2
+
+// Marks a message without a username in the log
+#define NO_USERNAME UINT32_MAX
+
+// Each message in the log is stored as this header, the username, then the message
+typedef struct log_record {
+  uint32_t username_len;
+  uint32_t message_len;
+} log_record_t;
+
+// Map a whole reserve of address space onto a file (NULL on failure)
+void* history_map(int fd, uint64_t reserve) {
+  void* mem = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+  return mem == MAP_FAILED ? NULL : mem;
+}
+
+// Open a file for the history and report its current size (-1 on failure)
+int history_open_file(char* path, char* suffix, uint64_t* size) {
+  char* name = malloc(strlen(path) + strlen(suffix) + 1);
+  strcpy(name, path);
+  strcat(name, suffix);
+  // Never follow a link to someone else's file, or use one someone else made for us
+  int fd = open(name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  free(name);
+  if(fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  if(fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  if(!S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+    close(fd);
+    errno = EPERM;
+    return -1;
+  }
+  *size = st.st_size;
+  return fd;
+}
+
+// Unmap and close whatever a history has open, and free it
+void history_release(history_t* history) {
+  if(history->log != NULL) {
+    munmap(history->log, HISTORY_LOG_RESERVE);
+  }
+  if(history->index != NULL) {
+    munmap(history->index, HISTORY_INDEX_RESERVE);
+  }
+  if(history->log_fd != -1) {
+    close(history->log_fd);
+  }
+  if(history->index_fd != -1) {
+    close(history->index_fd);
+  }
+  pthread_mutex_destroy(&history->m);
+  free(history);
+}
+
+history_t* history_open(char* path) {
+  history_t* history = calloc(1, sizeof(history_t));
+  pthread_mutex_init(&history->m, NULL);
+
+  uint64_t log_file_size;
+  uint64_t index_file_size;
+  history->log_fd = history_open_file(path, ".log", &log_file_size);
+  history->index_fd = history_open_file(path, ".idx", &index_file_size);
+  if(history->log_fd == -1 || history->index_fd == -1) {
+    perror("history open failed");
+    history_release(history);
+    return NULL;
+  }
+  // Only one process may append to a history; the lock goes away with us, however we exit
+  if(flock(history->log_fd, LOCK_EX | LOCK_NB) == -1) {
+    history_release(history);
+    return NULL;
+  }
+
+  // A new index needs room for its header before it can be mapped
+  if(index_file_size < INDEX_HEADER * sizeof(uint64_t)) {
+    index_file_size = HISTORY_INDEX_GROW * sizeof(uint64_t);
+    if(ftruncate(history->index_fd, index_file_size) == -1) {
+      perror("history ftruncate failed");
+      history_release(history);
+      return NULL;
+    }
+  }
+
+  history->log = history_map(history->log_fd, HISTORY_LOG_RESERVE);
+  history->index = history_map(history->index_fd, HISTORY_INDEX_RESERVE);
+  if(history->log == NULL || history->index == NULL) {
+    perror("history mmap failed");
+    history_release(history);
+    return NULL;
+  }
+  history->log_capacity = log_file_size;
+  history->index_capacity = index_file_size / sizeof(uint64_t);
+
+  // The header says how much of each file to trust, so it has to fit them
+  if(history->index[INDEX_COUNT] > history->index_capacity - INDEX_HEADER ||
+     history->index[INDEX_LOG_SIZE] > log_file_size) {
+    fprintf(stderr, "history %s is corrupt\n", path);
+    history_release(history);
+    return NULL;
+  }
+
+  // Pick up where an earlier run left off
+  history->count = history->index[INDEX_COUNT];
+  history->ring_start = history->count;
+  history->log_size = history->index[INDEX_LOG_SIZE];
+  return history;
+}
+
+// Append one entry to the log and index files, as message number count. Caller holds the lock.
+void history_spill(history_t* history, history_entry_t* entry) {
+  uint32_t username_len = entry->username == NULL ? 0 : strlen(entry->username);
+  uint32_t message_len = strlen(entry->message);
+  uint64_t record_size = sizeof(log_record_t) + username_len + message_len;
+
+  // Grow the files ahead of the write; the mappings already cover the new space
+  if(history->log_size + record_size > history->log_capacity) {
+    uint64_t capacity = history->log_capacity + HISTORY_LOG_GROW;
+    if(capacity < history->log_size + record_size) {
+      capacity = history->log_size + record_size;
+    }
+    if(capacity > HISTORY_LOG_RESERVE || ftruncate(history->log_fd, capacity) == -1) {
+      perror("history log full");
+      exit(EXIT_FAILURE);
+    }
+    history->log_capacity = capacity;
+  }
+  if(INDEX_HEADER + history->count + 1 > history->index_capacity) {
+    uint64_t capacity = history->index_capacity + HISTORY_INDEX_GROW;
+    if(capacity * sizeof(uint64_t) > HISTORY_INDEX_RESERVE ||
+       ftruncate(history->index_fd, capacity * sizeof(uint64_t)) == -1) {
+      perror("history index full");
+      exit(EXIT_FAILURE);
+    }
+    history->index_capacity = capacity;
+  }
+
+  log_record_t record = {
+    .username_len = entry->username == NULL ? NO_USERNAME : username_len,
+    .message_len = message_len
+  };
+  char* dest = history->log + history->log_size;
+  memcpy(dest, &record, sizeof(log_record_t));
+  memcpy(dest + sizeof(log_record_t), entry->username, username_len);
+  memcpy(dest + sizeof(log_record_t) + username_len, entry->message, message_len);
+
+  // Publish the record only after its bytes are in place
+  history->index[INDEX_HEADER + history->count] = history->log_size;
+  history->log_size += record_size;
+  history->index[INDEX_LOG_SIZE] = history->log_size;
+  history->index[INDEX_COUNT] = history->count + 1;
+}
+
+uint64_t history_append(history_t* history, char* username, char* message) {
+  // Copy outside the lock; only the file and ring updates need to be serialized
+  size_t len = strcspn(message, "\r\n");
+  char* message_copy = malloc(len + 1);
+  memcpy(message_copy, message, len);
+  message_copy[len] = '\0';
+  char* username_copy = username == NULL ? NULL : strdup(username);
+
+  pthread_mutex_lock(&history->m);
+  history_entry_t* slot = &history->ring[history->count % HISTORY_RING_SIZE];
+  // It goes to disk straight away, so it's kept however we exit. The mapping is shared, so the
+  // kernel writes it back even if we crash.
+  history_entry_t entry = { .username = username_copy, .message = message_copy };
+  history_spill(history, &entry);
+  // The oldest message in the ring makes room; it's on disk already
+  history_entry_free(slot);
+  *slot = entry;
+  uint64_t index = history->count++;
+  pthread_mutex_unlock(&history->m);
+  return index;
+}
+
+uint64_t history_count(history_t* history) {
+  pthread_mutex_lock(&history->m);
+  uint64_t count = history->count;
+  pthread_mutex_unlock(&history->m);
+  return count;
+}
+
+bool history_get(history_t* history, uint64_t index, history_entry_t* entry) {
+  pthread_mutex_lock(&history->m);
+  if(index >= history->count) {
+    pthread_mutex_unlock(&history->m);
+    return false;
+  }
+
+  if(index >= history->ring_start && history->count - index <= HISTORY_RING_SIZE) {
+    // Still in memory
+    history_entry_t* slot = &history->ring[index % HISTORY_RING_SIZE];
+    entry->username = slot->username == NULL ? NULL : strdup(slot->username);
+    entry->message = strdup(slot->message);
+  } else {
+    // Look up the record on disk through the index, which mustn't point outside the log
+    uint64_t offset = history->index[INDEX_HEADER + index];
+    if(offset > history->log_size || history->log_size - offset < sizeof(log_record_t)) {
+      pthread_mutex_unlock(&history->m);
+      return false;
+    }
+    char* src = history->log + offset;
+    log_record_t record;
+    memcpy(&record, src, sizeof(log_record_t));
+    src += sizeof(log_record_t);
+    uint64_t username_len = record.username_len == NO_USERNAME ? 0 : record.username_len;
+    if(history->log_size - offset - sizeof(log_record_t) < username_len + record.message_len) {
+      pthread_mutex_unlock(&history->m);
+      return false;
+    }
+
+    if(record.username_len == NO_USERNAME) {
+      entry->username = NULL;
+    } else {
+      entry->username = strndup(src, record.username_len);
+      src += record.username_len;
+    }
+    entry->message = strndup(src, record.message_len);
+  }
+  pthread_mutex_unlock(&history->m);
+  return true;
+}
+
+void history_entry_free(history_entry_t* entry) {
+  free(entry->username);
+  free(entry->message);
+  entry->username = NULL;
+  entry->message = NULL;
+}
+
+void history_close(history_t* history) {
+  for(int i = 0; i < HISTORY_RING_SIZE; i++) {
+    history_entry_free(&history->ring[i]);
+  }
+  history_release(history);
+}
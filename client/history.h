@@ -0,0 +1,99 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Recent messages kept in memory. Must be a power of two.
+#define HISTORY_RING_SIZE 1024
+
+/**
+ * A chat history that never forgets a message but keeps only a fixed number
+ * in memory. Each message is appended to a log file as it's added, and its
+ * offset to an index file, so none is lost however the process ends. The
+ * newest HISTORY_RING_SIZE are also kept in a ring, where they're read from.
+ * Both files are memory-mapped once with plenty of address space reserved,
+ * so appending is O(1) and any message can be found by its index without
+ * reading the ones before it. The kernel is free to page the mapped files
+ * out, so resident memory stays bounded however long the channel runs.
+ */
+typedef struct history_entry {
+  char* username;
+  char* message;
+} history_entry_t;
+
+typedef struct history {
+  pthread_mutex_t m;
+  // Messages [0, count) are on disk; those from ring_start on, the last
+  // HISTORY_RING_SIZE of them, are in the ring too
+  uint64_t count;
+  uint64_t ring_start;
+  history_entry_t ring[HISTORY_RING_SIZE];
+
+  int log_fd;
+  char* log;            // The reserved mapping of the log file
+  uint64_t log_size;    // Bytes of the log file that are in use
+  uint64_t log_capacity;
+
+  int index_fd;
+  uint64_t* index;      // Count, then log size, then the offset of each message
+  uint64_t index_capacity;
+} history_t;
+
+/**
+ * Open a history stored in files named after path, creating them if needed.
+ * Messages already on disk from an earlier run are kept. The files stay
+ * locked while they are open, so no two processes share them.
+ *
+ * \param path  Prefix for the log and index files. This function does *not*
+ *              take ownership of this memory.
+ *
+ * \returns The history, or NULL if the files could not be opened or mapped,
+ *          aren't our own regular files, are corrupt, or another process
+ *          has them open.
+ */
+history_t* history_open(char* path);
+
+/**
+ * Add a message to the end of the history. Safe to call from any thread.
+ *
+ * \param username  The sender, or NULL for a message without one. This
+ *                  function does *not* take ownership of this memory.
+ * \param message   The message text. A trailing newline is dropped. This
+ *                  function does *not* take ownership of this memory.
+ *
+ * \returns The index of the new message.
+ */
+uint64_t history_append(history_t* history, char* username, char* message);
+
+/**
+ * Get the number of messages in the history.
+ */
+uint64_t history_count(history_t* history);
+
+/**
+ * Copy a message out of the history.
+ *
+ * \param index  The message to read, counting from 0 for the oldest.
+ * \param entry  Filled in with newly allocated copies of the username (NULL
+ *               if there was none) and message. Release them with
+ *               history_entry_free.
+ *
+ * \returns true on success, false if index is out of range or its record
+ *          on disk is corrupt.
+ */
+bool history_get(history_t* history, uint64_t index, history_entry_t* entry);
+
+/**
+ * Free the strings held by an entry filled in by history_get.
+ */
+void history_entry_free(history_entry_t* entry);
+
+/**
+ * Release the history. Everything in it is on disk already.
+ */
+void history_close(history_t* history);
+
+#endif
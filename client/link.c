@@ -0,0 +1,759 @@
+#include "link.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// The user_data of the sender's read on its wakeup eventfd
+#define LINK_URING_WAKE UINT64_MAX
+
+// The io_uring backend, if in use, and the links it sends for by slot
+uring_t* link_uring = NULL;
+link_t* link_uring_links[LINK_URING_SLOTS];
+pthread_mutex_t link_uring_lock = PTHREAD_MUTEX_INITIALIZER;
+// Written to wake the sender; link_uring_woken saves writing it again before it looks
+int link_uring_wake_fd = -1;
+atomic_bool link_uring_woken = false;
+// Wakeups held back by link_batch_begin on this thread
+_Thread_local int link_batch_depth = 0;
+_Thread_local bool link_batch_wake = false;
+
+void* link_writer_fn(void* p);
+
+// Start a writer thread for a link
+void link_start_writer(link_t* link) {
+  pthread_t writer;
+  if(pthread_create(&writer, NULL, link_writer_fn, link)) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(writer);
+}
+
+link_t* link_open(int sockfd, char* name) {
+  link_t* link = malloc(sizeof(link_t));
+  link->name = name;
+  link->sockfd = sockfd;
+  link->caps = 0;
+  link->has_interest = false;
+  bloom_clear(&link->interest);
+  link->peer_id = 0;
+  link->subtree_size = 0;
+  link->subtree_height = 0;
+  link->peer_spare = 0;
+  link->peer_port = 0;
+  link->leaving = false;
+  link->moved = false;
+  link->shard = 0;
+  pthread_mutex_init(&link->m, NULL);
+
+  for(int c = 0; c < LINK_CLASSES; c++) {
+    link->head[c] = NULL;
+    link->tail[c] = NULL;
+    link->queued[c] = 0;
+    link->owed[c] = 0;
+  }
+  link->credits[LINK_CLASS_CONTROL] = 0;
+  link->credits[LINK_CLASS_INTERACTIVE] = LINK_WINDOW_INTERACTIVE;
+  link->credits[LINK_CLASS_BULK] = LINK_WINDOW_BULK;
+  pthread_cond_init(&link->ready, NULL);
+  pthread_cond_init(&link->room, NULL);
+  link->closing = false;
+  link->broken = false;
+  link->writer_done = false;
+  link->writing = false;
+  atomic_init(&link->refs, 1);
+  link->shm = NULL;
+  link->shm_in = false;
+  link->shm_out = false;
+  link->slot = -1;
+  link->out_used = 0;
+  link->in_flight = false;
+  link->partial = NULL;
+  link->partial_offset = 0;
+  link->moving = false;
+
+  // Duplicate the socket_fd so we can open it twice, once for input and once for output
+  int sockfd_copy = dup(sockfd);
+  if(sockfd_copy == -1) {
+    perror("dup failed");
+    exit(EXIT_FAILURE);
+  }
+  link->input = fdopen(sockfd, "r");
+  link->output = fdopen(sockfd_copy, "w");
+  if(link->input == NULL || link->output == NULL) {
+    perror("fdopen failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Hand the link to the io_uring sender if there's a buffer free for it
+  if(link_uring != NULL) {
+    pthread_mutex_lock(&link_uring_lock);
+    for(int s = 0; s < LINK_URING_SLOTS && link->slot == -1; s++) {
+      if(link_uring_links[s] == NULL) {
+        link_uring_links[s] = link;
+        link->slot = s;
+      }
+    }
+    pthread_mutex_unlock(&link_uring_lock);
+  }
+  if(link->slot == -1) {
+    link_start_writer(link);
+  }
+  return link;
+}
+
+// Wake the io_uring sender, unless it's already been woken and hasn't looked yet
+void link_uring_kick() {
+  if(!atomic_exchange(&link_uring_woken, true)) {
+    uint64_t one = 1;
+    write(link_uring_wake_fd, &one, sizeof(one));
+  }
+}
+
+// Let a link's writer know it may have something to do. Caller holds the lock.
+void link_wake(link_t* link) {
+  pthread_cond_signal(&link->ready);
+  if(link->slot != -1) {
+    if(link_batch_depth > 0) {
+      link_batch_wake = true;
+    } else {
+      link_uring_kick();
+    }
+  }
+}
+
+void link_batch_begin() {
+  link_batch_depth++;
+}
+
+void link_batch_end() {
+  if(--link_batch_depth == 0 && link_batch_wake) {
+    link_batch_wake = false;
+    link_uring_kick();
+  }
+}
+
+// The class of a frame type
+int link_type_class(uint8_t type) {
+  if(type == FRAME_MSG) {
+    return LINK_CLASS_INTERACTIVE;
+  } else if(type == FRAME_XFER || type == FRAME_CHUNK) {
+    return LINK_CLASS_BULK;
+  }
+  return LINK_CLASS_CONTROL;
+}
+
+int link_class(frame_t* frame) {
+  return link_type_class(frame->type);
+}
+
+// The most frames of a class a sender may have unacknowledged
+int link_window(int class) {
+  return class == LINK_CLASS_BULK ? LINK_WINDOW_BULK : LINK_WINDOW_INTERACTIVE;
+}
+
+// Add a frame to the back of its queue, taking over the caller's reference. Caller holds the lock.
+void link_enqueue(link_t* link, frame_t* frame) {
+  int c = link_class(frame);
+  link_queue_node_t* node = malloc(sizeof(link_queue_node_t));
+  node->frame = frame;
+  node->next = NULL;
+  if(link->tail[c] == NULL) {
+    link->head[c] = node;
+  } else {
+    link->tail[c]->next = node;
+  }
+  link->tail[c] = node;
+  link->queued[c]++;
+  link_wake(link);
+}
+
+// The highest class with a frame we may send now, or -1. Caller holds the lock.
+int link_next_class(link_t* link) {
+  for(int c = 0; c < LINK_CLASSES; c++) {
+    if(link->head[c] == NULL) {
+      continue;
+    }
+    // Once the link is broken, frames are only being thrown away
+    if(c == LINK_CLASS_CONTROL || link->broken || !(link->caps & LINK_CAP_CREDIT) ||
+       link->credits[c] > 0) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+// Take the frame at the front of a class's queue. Caller holds the lock.
+frame_t* link_dequeue(link_t* link, int c) {
+  link_queue_node_t* node = link->head[c];
+  link->head[c] = node->next;
+  if(link->head[c] == NULL) {
+    link->tail[c] = NULL;
+  }
+  link->queued[c]--;
+  frame_t* frame = node->frame;
+  free(node);
+  return frame;
+}
+
+// Unlink everything still queued, returning it as one list. Caller holds the lock.
+link_queue_node_t* link_take_queued(link_t* link) {
+  link_queue_node_t* left = NULL;
+  for(int c = 0; c < LINK_CLASSES; c++) {
+    if(link->tail[c] != NULL) {
+      link->tail[c]->next = left;
+      left = link->head[c];
+      link->head[c] = NULL;
+      link->tail[c] = NULL;
+      link->queued[c] = 0;
+    }
+  }
+  return left;
+}
+
+// Free a list of queue nodes and their frames
+void link_free_queued(link_queue_node_t* left) {
+  while(left != NULL) {
+    link_queue_node_t* next = left->next;
+    frame_free(left->frame);
+    free(left);
+    left = next;
+  }
+}
+
+void* link_writer_fn(void* p) {
+  link_t* link = (link_t*)p;
+  pthread_mutex_lock(&link->m);
+  while(true) {
+    int c = link_next_class(link);
+    if(c == -1) {
+      if(link->closing) {
+        break;
+      }
+      pthread_cond_wait(&link->ready, &link->m);
+      continue;
+    }
+    frame_t* frame = link_dequeue(link, c);
+    if(c != LINK_CLASS_CONTROL && (link->caps & LINK_CAP_CREDIT)) {
+      link->credits[c]--;
+    }
+    bool broken = link->broken;
+    bool more = link_next_class(link) != -1;
+    link->writing = true;
+    pthread_mutex_unlock(&link->m);
+
+    int result = 0;
+    if(broken) {
+      // Just throwing it away
+    } else if(link->shm_out) {
+      result = shm_write_frame(link->shm, frame);
+    } else {
+      result = frame_write(link->output, frame);
+      // Flush once nothing else is ready to go, so a burst shares system calls
+      bool moving = frame->type == FRAME_SHM;
+      if(result == 0 && (!more || moving) && fflush(link->output) != 0) {
+        result = -1;
+      }
+      // Everything after our FRAME_SHM goes through shared memory
+      if(result == 0 && moving) {
+        link->shm_out = true;
+      }
+    }
+    // Freed unlocked, since it may return credit on another link
+    frame_free(frame);
+
+    pthread_mutex_lock(&link->m);
+    link->writing = false;
+    if(result == -1) {
+      link->broken = true;
+    }
+    pthread_cond_broadcast(&link->room);
+  }
+
+  // Whatever is left is waiting on credit that will never come
+  link_queue_node_t* left = link_take_queued(link);
+  pthread_mutex_unlock(&link->m);
+  link_free_queued(left);
+
+  pthread_mutex_lock(&link->m);
+  link->writer_done = true;
+  pthread_cond_broadcast(&link->room);
+  pthread_mutex_unlock(&link->m);
+  return NULL;
+}
+
+// Frames the sender is done with this round, freed once it holds no lock
+typedef struct link_sent {
+  frame_t** frames;
+  int count;
+  int capacity;
+} link_sent_t;
+
+void link_sent_add(link_sent_t* sent, frame_t* frame) {
+  if(sent->count == sent->capacity) {
+    sent->capacity = sent->capacity == 0 ? 64 : 2 * sent->capacity;
+    sent->frames = realloc(sent->frames, sizeof(frame_t*) * sent->capacity);
+  }
+  sent->frames[sent->count++] = frame;
+}
+
+// Copy queued frames into a link's buffer until it's full or nothing more may go. Caller holds the lock.
+void link_uring_fill(link_t* link, link_sent_t* sent) {
+  char* buffer = uring_buffer(link_uring, link->slot);
+  while(link->out_used < LINK_URING_BUFFER && !link->moving) {
+    if(link->partial == NULL) {
+      int c = link_next_class(link);
+      if(c == -1) {
+        break;
+      }
+      link->partial = link_dequeue(link, c);
+      if(c != LINK_CLASS_CONTROL && (link->caps & LINK_CAP_CREDIT)) {
+        link->credits[c]--;
+      }
+      link->partial_offset = 0;
+      frame_encode_header(link->partial, link->partial_header);
+    }
+
+    // A frame is its header then its payload, and may take more than one buffer
+    frame_t* frame = link->partial;
+    uint32_t total = FRAME_HEADER_SIZE + frame->length;
+    uint32_t n = total - link->partial_offset;
+    if(n > LINK_URING_BUFFER - link->out_used) {
+      n = LINK_URING_BUFFER - link->out_used;
+    }
+    char* dst = buffer + link->out_used;
+    uint32_t offset = link->partial_offset;
+    uint32_t left = n;
+    if(offset < FRAME_HEADER_SIZE) {
+      uint32_t part = left < FRAME_HEADER_SIZE - offset ? left : FRAME_HEADER_SIZE - offset;
+      memcpy(dst, link->partial_header + offset, part);
+      dst += part;
+      offset += part;
+      left -= part;
+    }
+    memcpy(dst, frame->payload + (offset - FRAME_HEADER_SIZE), left);
+    link->out_used += n;
+    link->partial_offset += n;
+
+    if(link->partial_offset == total) {
+      // Everything after our FRAME_SHM goes through shared memory, from a thread of its own
+      if(frame->type == FRAME_SHM) {
+        link->moving = true;
+      }
+      link_sent_add(sent, frame);
+      link->partial = NULL;
+    }
+  }
+  pthread_cond_broadcast(&link->room);
+}
+
+// Take a link away from the sender. Caller holds the link's lock.
+void link_uring_remove(link_t* link) {
+  pthread_mutex_lock(&link_uring_lock);
+  link_uring_links[link->slot] = NULL;
+  pthread_mutex_unlock(&link_uring_lock);
+  link->slot = -1;
+}
+
+// Get a link that isn't being written ready for this round: fill its buffer, or retire it
+void link_uring_prepare(link_t* link, link_sent_t* sent) {
+  pthread_mutex_lock(&link->m);
+  if(link->broken) {
+    // Nothing more can go out, so throw away everything it was going to send
+    link->out_used = 0;
+    link->moving = false;
+    if(link->partial != NULL) {
+      link_sent_add(sent, link->partial);
+      link->partial = NULL;
+    }
+    for(int c = 0; c < LINK_CLASSES; c++) {
+      while(link->head[c] != NULL) {
+        link_sent_add(sent, link_dequeue(link, c));
+      }
+    }
+    pthread_cond_broadcast(&link->room);
+  } else {
+    link_uring_fill(link, sent);
+  }
+
+  if(link->out_used > 0) {
+    if(uring_write_fixed(link_uring, fileno(link->output), link->slot, link->out_used, link->slot) == -1) {
+      fprintf(stderr, "io_uring submission ring overflowed\n");
+      exit(EXIT_FAILURE);
+    }
+    link->in_flight = true;
+  } else if(link->moving) {
+    // The FRAME_SHM is out, so its own writer takes the link from here
+    link->moving = false;
+    link->shm_out = true;
+    link_uring_remove(link);
+    link_start_writer(link);
+  } else if(link->closing && link->partial == NULL && link_next_class(link) == -1) {
+    // Whatever is left is waiting on credit that will never come
+    link_queue_node_t* left = link_take_queued(link);
+    link_uring_remove(link);
+    pthread_mutex_unlock(&link->m);
+    link_free_queued(left);
+    pthread_mutex_lock(&link->m);
+    link->writer_done = true;
+    pthread_cond_broadcast(&link->room);
+  }
+  pthread_mutex_unlock(&link->m);
+}
+
+// Take the result of a write from a link's buffer
+void link_uring_written(link_t* link, int result) {
+  pthread_mutex_lock(&link->m);
+  link->in_flight = false;
+  if(result == -EINTR || result == -EAGAIN) {
+    // Nothing went; it's tried again next round
+  } else if(result < 0) {
+    link->broken = true;
+    pthread_cond_broadcast(&link->room);
+  } else {
+    // Keep whatever a short write left over at the front of the buffer
+    char* buffer = uring_buffer(link_uring, link->slot);
+    memmove(buffer, buffer + result, link->out_used - result);
+    link->out_used -= result;
+    if(link->out_used == 0) {
+      pthread_cond_broadcast(&link->room);
+    }
+  }
+  pthread_mutex_unlock(&link->m);
+}
+
+// The io_uring sender. Each round fills the buffer of every link not already being written,
+// submits all those writes at once, and waits for a write to finish or a new frame to be queued.
+void* link_uring_fn(void* p) {
+  uint64_t wakeups;
+  uring_read(link_uring, link_uring_wake_fd, &wakeups, sizeof(wakeups), LINK_URING_WAKE);
+  link_sent_t sent = { NULL, 0, 0 };
+  while(true) {
+    // Only this thread removes links, so the ones seen here stay until it does
+    link_t* links[LINK_URING_SLOTS];
+    pthread_mutex_lock(&link_uring_lock);
+    memcpy(links, link_uring_links, sizeof(links));
+    pthread_mutex_unlock(&link_uring_lock);
+
+    for(int s = 0; s < LINK_URING_SLOTS; s++) {
+      if(links[s] != NULL && !links[s]->in_flight) {
+        link_uring_prepare(links[s], &sent);
+      }
+    }
+    // Freed unlocked, since they may return credit on other links
+    for(int i = 0; i < sent.count; i++) {
+      frame_free(sent.frames[i]);
+    }
+    sent.count = 0;
+
+    if(uring_submit(link_uring, 1) == -1) {
+      perror("io_uring_enter failed");
+      exit(EXIT_FAILURE);
+    }
+    uint64_t user_data;
+    int result;
+    while(uring_complete(link_uring, &user_data, &result)) {
+      if(user_data == LINK_URING_WAKE) {
+        // Lower the flag before looking at the links, so nothing queued after goes unseen
+        atomic_store(&link_uring_woken, false);
+        uring_read(link_uring, link_uring_wake_fd, &wakeups, sizeof(wakeups), LINK_URING_WAKE);
+      } else {
+        link_uring_written(links[user_data], result);
+      }
+    }
+  }
+  return NULL;
+}
+
+int link_use_uring() {
+  // Room for a write per link plus the wakeup read
+  link_uring = uring_create(2 * LINK_URING_SLOTS, LINK_URING_BUFFER, LINK_URING_SLOTS);
+  if(link_uring == NULL) {
+    return -1;
+  }
+  link_uring_wake_fd = eventfd(0, EFD_CLOEXEC);
+  if(link_uring_wake_fd == -1) {
+    uring_destroy(link_uring);
+    link_uring = NULL;
+    return -1;
+  }
+  pthread_t sender;
+  if(pthread_create(&sender, NULL, link_uring_fn, NULL)) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(sender);
+  return 0;
+}
+
+link_t* link_retain(link_t* link) {
+  atomic_fetch_add(&link->refs, 1);
+  return link;
+}
+
+void link_release(link_t* link) {
+  if(atomic_fetch_sub(&link->refs, 1) != 1) {
+    return;
+  }
+  pthread_cond_destroy(&link->ready);
+  pthread_cond_destroy(&link->room);
+  pthread_mutex_destroy(&link->m);
+  free(link);
+}
+
+// Called as a received frame is freed: we're done with it, so its sender may send another
+void link_grant(void* arg, uint8_t type) {
+  link_t* link = (link_t*)arg;
+  int c = link_type_class(type);
+  pthread_mutex_lock(&link->m);
+  if(!link->closing && !link->broken) {
+    link->owed[c]++;
+    // Return credit in batches of half a window, so the sender never runs dry waiting on it
+    if(link->owed[c] >= link_window(c) / 2) {
+      uint32_t payload[2] = {
+        htonl(link->owed[LINK_CLASS_INTERACTIVE]),
+        htonl(link->owed[LINK_CLASS_BULK])
+      };
+      link->owed[LINK_CLASS_INTERACTIVE] = 0;
+      link->owed[LINK_CLASS_BULK] = 0;
+      link_enqueue(link, frame_create(FRAME_CREDIT, 0, 0, (char*)payload, sizeof(payload)));
+    }
+  }
+  pthread_mutex_unlock(&link->m);
+  link_release(link);
+}
+
+// Send our capabilities in a HELLO frame
+int link_send_hello(link_t* link, uint32_t caps) {
+  uint32_t payload = htonl(caps);
+  frame_t* hello = frame_create(FRAME_HELLO, 0, 0, (char*)&payload, sizeof(payload));
+  int result = link_send(link, hello);
+  frame_free(hello);
+  return result;
+}
+
+// Get the capabilities out of a HELLO frame (-1 if it isn't one)
+int64_t link_hello_caps(frame_t* hello) {
+  if(hello == NULL || hello->type != FRAME_HELLO || hello->length != sizeof(uint32_t)) {
+    return -1;
+  }
+  uint32_t caps;
+  memcpy(&caps, hello->payload, sizeof(caps));
+  return ntohl(caps);
+}
+
+int link_handshake(link_t* link, uint32_t offered) {
+  if(link_send_hello(link, offered) == -1) {
+    return -1;
+  }
+  frame_t* hello = link_recv(link);
+  int64_t agreed = link_hello_caps(hello);
+  frame_free(hello);
+  if(agreed == -1) {
+    return -1;
+  }
+  link->caps = agreed & offered;
+  return 0;
+}
+
+int link_accept(link_t* link, frame_t* hello, uint32_t offered) {
+  int64_t theirs = link_hello_caps(hello);
+  if(theirs == -1) {
+    return -1;
+  }
+  link->caps = theirs & offered;
+  return link_send_hello(link, link->caps);
+}
+
+// Queue a frame, waiting for room in its class first if asked to
+int link_queue_frame(link_t* link, frame_t* frame, bool wait) {
+  int c = link_class(frame);
+  pthread_mutex_lock(&link->m);
+  while(wait && c != LINK_CLASS_CONTROL && !link->broken && !link->closing &&
+        link->queued[c] >= link_window(c)) {
+    // Frames held back by a batch may be what has to go before there's room
+    if(link_batch_wake) {
+      link_batch_wake = false;
+      link_uring_kick();
+    }
+    pthread_cond_wait(&link->room, &link->m);
+  }
+  int result = -1;
+  if(!link->broken && !link->closing) {
+    link_enqueue(link, frame_retain(frame));
+    result = 0;
+  }
+  pthread_mutex_unlock(&link->m);
+  return result;
+}
+
+int link_send(link_t* link, frame_t* frame) {
+  return link_queue_frame(link, frame, false);
+}
+
+int link_send_wait(link_t* link, frame_t* frame) {
+  return link_queue_frame(link, frame, true);
+}
+
+// Send a FRAME_SHM naming a channel
+int link_send_shm(link_t* link, uint64_t token) {
+  uint32_t payload[2] = { htonl(token >> 32), htonl(token & 0xffffffff) };
+  frame_t* frame = frame_create(FRAME_SHM, 0, 0, (char*)payload, sizeof(payload));
+  int result = link_send(link, frame);
+  frame_free(frame);
+  return result;
+}
+
+int link_offer_shm(link_t* link, char* name) {
+  shm_channel_t* shm = shm_create(link->sockfd);
+  if(shm == NULL) {
+    return -1;
+  }
+  uint64_t token = ((uint64_t)random() << 32) ^ random();
+  if(shm_offer(shm, name, token) == -1) {
+    shm_destroy(shm);
+    return -1;
+  }
+  pthread_mutex_lock(&link->m);
+  link->shm = shm;
+  pthread_mutex_unlock(&link->m);
+  return link_send_shm(link, token);
+}
+
+// Handle a FRAME_SHM: claim the channel it names, or take it as the answer to our offer
+int link_receive_shm(link_t* link, frame_t* frame) {
+  if(frame->length != 2 * sizeof(uint32_t)) {
+    return -1;
+  }
+  if(link->shm == NULL) {
+    uint32_t payload[2];
+    memcpy(payload, frame->payload, sizeof(payload));
+    uint64_t token = ((uint64_t)ntohl(payload[0]) << 32) | ntohl(payload[1]);
+    shm_channel_t* shm = shm_claim(token, link->sockfd);
+    if(shm == NULL) {
+      return -1;
+    }
+    pthread_mutex_lock(&link->m);
+    link->shm = shm;
+    pthread_mutex_unlock(&link->m);
+    // Our answer is the last thing we send over TCP
+    if(link_send_shm(link, token) == -1) {
+      return -1;
+    }
+  }
+  // Everything the peer sent after its FRAME_SHM is in shared memory
+  link->shm_in = true;
+  return 0;
+}
+
+// Whether nothing is left to write. Caller holds the lock.
+bool link_empty(link_t* link) {
+  for(int c = 0; c < LINK_CLASSES; c++) {
+    if(link->queued[c] > 0) {
+      return false;
+    }
+  }
+  return !link->writing && link->partial == NULL && link->out_used == 0 && !link->in_flight;
+}
+
+int link_flush(link_t* link, int timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&link->m);
+  // Frames held back by a batch have to go before the link can empty
+  if(link_batch_wake) {
+    link_batch_wake = false;
+    link_uring_kick();
+  }
+  int result = 0;
+  while(!link_empty(link)) {
+    if(link->broken || link->writer_done ||
+       pthread_cond_timedwait(&link->room, &link->m, &deadline) == ETIMEDOUT) {
+      result = -1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&link->m);
+  return result;
+}
+
+frame_t* link_recv(link_t* link) {
+  while(true) {
+    frame_t* frame = link->shm_in ? shm_read_frame(link->shm) : frame_read(link->input);
+    if(frame == NULL) {
+      // Nothing more will be read, so no more credit will come; let waiting senders go
+      pthread_mutex_lock(&link->m);
+      link->broken = true;
+      link_wake(link);
+      pthread_cond_broadcast(&link->room);
+      pthread_mutex_unlock(&link->m);
+      return NULL;
+    }
+
+    if(frame->type == FRAME_CREDIT) {
+      if(frame->length == 2 * sizeof(uint32_t)) {
+        uint32_t payload[2];
+        memcpy(payload, frame->payload, sizeof(payload));
+        pthread_mutex_lock(&link->m);
+        link->credits[LINK_CLASS_INTERACTIVE] += ntohl(payload[0]);
+        link->credits[LINK_CLASS_BULK] += ntohl(payload[1]);
+        link_wake(link);
+        pthread_mutex_unlock(&link->m);
+      }
+      frame_free(frame);
+      continue;
+    }
+
+    if(frame->type == FRAME_SHM && !link->shm_in) {
+      int result = link_receive_shm(link, frame);
+      frame_free(frame);
+      if(result == -1) {
+        // The peer has already moved off TCP, so there's no going on without the channel
+        pthread_mutex_lock(&link->m);
+        link->broken = true;
+        link_wake(link);
+        pthread_cond_broadcast(&link->room);
+        pthread_mutex_unlock(&link->m);
+        return NULL;
+      }
+      continue;
+    }
+
+    // Credit goes back once every copy of this frame is gone
+    if(link_class(frame) != LINK_CLASS_CONTROL && (link->caps & LINK_CAP_CREDIT)) {
+      frame->on_release = link_grant;
+      frame->release_arg = link_retain(link);
+    }
+    return frame;
+  }
+}
+
+void link_close(link_t* link) {
+  pthread_mutex_lock(&link->m);
+  link->closing = true;
+  link_wake(link);
+  pthread_cond_broadcast(&link->room);
+  while(!link->writer_done) {
+    pthread_cond_wait(&link->room, &link->m);
+  }
+  pthread_mutex_unlock(&link->m);
+
+  fclose(link->input);
+  fclose(link->output);
+  if(link->shm != NULL) {
+    shm_destroy(link->shm);
+  }
+  link_release(link);
+}
@@ -0,0 +1,255 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "channel.h"
+#include "frame.h"
+#include "shm.h"
+#include "uring.h"
+
+// Capabilities a link can agree on during its handshake
+#define LINK_CAP_LZ 0x01       // Compressed frames may be sent as-is
+#define LINK_CAP_CREDIT 0x02   // Chat and bulk frames are flow-controlled by credit
+#define LINK_CAP_SHM 0x04      // The link can move onto shared memory; see shm.h
+
+/**
+ * Frames are queued by class, and a link's writer always sends the highest
+ * class it can. Control frames keep the tree working and are never held
+ * back. Chat messages are small and someone is waiting on them, so they go
+ * ahead of any transfer chunks queued on the same link.
+ */
+#define LINK_CLASS_CONTROL 0
+#define LINK_CLASS_INTERACTIVE 1
+#define LINK_CLASS_BULK 2
+#define LINK_CLASSES 3
+
+/**
+ * Credit-based flow control. A sender starts with a window of credits for
+ * each flow-controlled class and spends one per frame. The receiver gives a
+ * credit back, in a FRAME_CREDIT, only once it is completely done with the
+ * frame: handled here and sent on to every other neighbor. So a relay holds
+ * at most a window of frames from each upstream link however slow its
+ * downstream links are. A slow link fills up, its relay stops returning
+ * credit upstream, and the pressure walks back up the tree to the sender,
+ * whose own queues are capped at a window.
+ *
+ * FRAME_CREDIT payload: interactive credits (4) | bulk credits (4)
+ */
+#define LINK_WINDOW_INTERACTIVE 64
+#define LINK_WINDOW_BULK 16
+
+typedef struct link_queue_node {
+  frame_t* frame;
+  struct link_queue_node* next;
+} link_queue_node_t;
+
+/**
+ * With the io_uring backend (see link_use_uring), one thread sends for every
+ * TCP link. Each link gets one of these registered buffers, and the sender
+ * copies queued frames into it and writes them out; a round writes every
+ * link with something to send in a single system call.
+ */
+#define LINK_URING_SLOTS 64
+#define LINK_URING_BUFFER (64 * 1024)
+
+/**
+ * A connection to a neighbor in the tree, either our parent or a child.
+ * Frames are read by one thread. Any thread may send: frames are queued on
+ * the link, and the link's writer sends them. The writer is either the
+ * link's own thread or the shared io_uring sender.
+ *
+ * A child's interest is the filter of channels its subtree last advertised.
+ * Until it advertises one, it is sent every channel.
+ *
+ * A child's peer_id and subtree fields come from its FRAME_SUMMARY frames.
+ *
+ * A link between peers on the same host can move off TCP onto a shared
+ * memory channel. The connecting side offers the channel and sends a
+ * FRAME_SHM naming it; the other side claims it and answers with a
+ * FRAME_SHM of its own. Each side's writer switches to the channel right
+ * after sending its FRAME_SHM, and its reader right after reading the
+ * other's, so no frame is reordered by the move.
+ */
+typedef struct link {
+  char* name;
+  int sockfd;
+  pthread_mutex_t m;
+  FILE* input;
+  FILE* output;
+  uint32_t caps;
+  bool has_interest;
+  bloom_t interest;
+  // What a child last told us about its subtree; size 0 until it does
+  uint32_t peer_id;
+  uint32_t subtree_size;
+  uint16_t subtree_height;
+  uint16_t peer_spare;     // Children it has room for
+  uint16_t peer_port;      // The port it takes children on; 0 if it hasn't said
+  bool leaving;            // It has left or moved away as we leave; its place is already given up
+  bool moved;              // It moved up to our parent, which relays to it now
+  // Which fan-out worker relays to this neighbor; see pipeline.h
+  int shard;
+
+  // Outbound frames by class, guarded by m
+  link_queue_node_t* head[LINK_CLASSES];
+  link_queue_node_t* tail[LINK_CLASSES];
+  int queued[LINK_CLASSES];
+  // Frames we may still send, and credit we owe the neighbor, by class
+  int credits[LINK_CLASSES];
+  int owed[LINK_CLASSES];
+  pthread_cond_t ready;    // Signaled when the writer may have something to send
+  pthread_cond_t room;     // Broadcast when a queue shrinks
+  bool closing;
+  bool broken;             // A write failed; queued frames are dropped
+  bool writer_done;        // The writer has stopped; broadcast on room
+  bool writing;            // The writer thread has taken a frame it hasn't finished writing
+  atomic_int refs;         // The link itself, plus each received frame still in use
+
+  // The shared memory channel, if any, and which directions have moved onto it
+  shm_channel_t* shm;
+  bool shm_in;             // Only touched by the reader
+  bool shm_out;            // Only touched by the writer
+
+  // Sending through the io_uring backend; everything but slot is only touched by the sender
+  int slot;                // The link's registered buffer, or -1 if it has a writer thread
+  size_t out_used;         // Bytes in the buffer not written yet
+  bool in_flight;          // A write from the buffer is with the kernel
+  frame_t* partial;        // A frame only partly copied into the buffer
+  uint32_t partial_offset;
+  unsigned char partial_header[FRAME_HEADER_SIZE];
+  bool moving;             // Our FRAME_SHM is in the buffer; the link moves once it's written
+} link_t;
+
+/**
+ * Send for TCP links from one thread through io_uring rather than a thread
+ * per link. Call once, before any link is opened. Links past
+ * LINK_URING_SLOTS, and links once they move onto shared memory, still get
+ * their own writer thread. Reading is unchanged: every link keeps its own
+ * reader thread either way.
+ *
+ * \returns 0 on success, -1 if the kernel has no io_uring, in which case
+ *          every link keeps its own writer thread.
+ */
+int link_use_uring();
+
+/**
+ * Hold back waking the io_uring sender until link_batch_end, so frames this
+ * thread queues on several links in between go out in the same round. Does
+ * nothing for links with their own writer threads.
+ */
+void link_batch_begin();
+
+/**
+ * Wake the io_uring sender for everything queued since link_batch_begin.
+ */
+void link_batch_end();
+
+/**
+ * Wrap a connected socket in a link and start its writer. The link owns the
+ * socket from now on.
+ *
+ * \param name  A label for the neighbor. Not owned by the link.
+ *
+ * \returns The link. Exits if the socket can't be opened as streams.
+ */
+link_t* link_open(int sockfd, char* name);
+
+/**
+ * Agree on capabilities with the peer we connected to. We offer ours and it
+ * answers with the capabilities both support, which both then use.
+ *
+ * \param offered  The capabilities this side supports.
+ *
+ * \returns 0 on success, -1 if the peer hung up or refused us.
+ */
+int link_handshake(link_t* link, uint32_t offered);
+
+/**
+ * Answer the HELLO frame a peer that connected to us opened with.
+ *
+ * \param hello    The first frame the peer sent. Not owned by this function.
+ * \param offered  The capabilities this side supports.
+ *
+ * \returns 0 on success, -1 if hello isn't a HELLO or the peer hung up.
+ */
+int link_accept(link_t* link, frame_t* hello, uint32_t offered);
+
+/**
+ * Move a link to a peer on the same host onto shared memory. The FRAME_SHM
+ * naming the channel is a control frame, so it goes out ahead of any queued
+ * chat or bulk frames; everything the writer dequeues after it, including
+ * frames queued before the offer, goes through the channel.
+ *
+ * \param name  The unix socket the peer takes channels on. Not owned by
+ *              this function.
+ *
+ * \returns 0 if the channel was handed over, -1 if the link stays on TCP.
+ */
+int link_offer_shm(link_t* link, char* name);
+
+/**
+ * Get the class a frame is queued in.
+ */
+int link_class(frame_t* frame);
+
+/**
+ * Queue a frame to be sent. Never blocks, so relays can always make
+ * progress; credit bounds how much they queue. Safe to call from any thread.
+ *
+ * \param frame  The frame. The link takes its own reference.
+ *
+ * \returns 0 on success, -1 if the connection is broken.
+ */
+int link_send(link_t* link, frame_t* frame);
+
+/**
+ * Queue a frame we created, first waiting until its class has less than a
+ * window queued. This is where back-pressure finally stops a sender.
+ *
+ * \returns 0 on success, -1 if the connection is broken.
+ */
+int link_send_wait(link_t* link, frame_t* frame);
+
+/**
+ * Wait until everything queued on the link has been written, or it can't
+ * be. Frames still waiting on credit count as queued.
+ *
+ * \param timeout_ms  The longest to wait.
+ *
+ * \returns 0 once the link is empty, -1 if it timed out or broke first.
+ */
+int link_flush(link_t* link, int timeout_ms);
+
+/**
+ * Read the next frame from the link. Only one thread should read a link.
+ * Credit frames are handled here and never returned. Credit for other
+ * frames goes back to the neighbor when they are freed.
+ *
+ * \returns The frame, or NULL if the connection closed or sent garbage.
+ */
+frame_t* link_recv(link_t* link);
+
+/**
+ * Take a reference to a link, so it isn't freed while it's still in use.
+ *
+ * \returns The link.
+ */
+link_t* link_retain(link_t* link);
+
+/**
+ * Drop a reference to a link, freeing it with the last one.
+ */
+void link_release(link_t* link);
+
+/**
+ * Stop the writer once it has sent what it can, close the connection, and
+ * drop the link. It is freed once no received frame still refers to it.
+ */
+void link_close(link_t* link);
+
+#endif
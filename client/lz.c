@@ -0,0 +1,208 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+/**
+ * Text every peer knows in advance. Matches may point back into it, which is
+ * what lets a one-line message compress at all. Changing it changes the wire
+ * format, so peers only use it once they've agreed on LINK_CAP_LZ.
+ */
+char lz_dictionary[] =
+  " the and that have for not with you this but his from they say her she "
+  "will one all would there their what out about who get which when make "
+  "can like time just him know take people into year your good some could "
+  "them see other than then now look only come its over think also back "
+  "after use two how our work first well way even new want because any "
+  "these give day most us is are was were been has had do does did doing "
+  "hello hi hey thanks thank you please sorry yes no okay ok sure lol "
+  "haha what's that's it's I'm I'll I've don't can't won't didn't isn't "
+  "doesn't let's here where why going gonna anyone everyone someone "
+  "something anything nothing message channel server client network "
+  "connect connection disconnect join leave quit error problem issue "
+  "working broken fixed update release version build test tests testing "
+  "meeting tomorrow today tonight morning afternoon evening minute minutes "
+  "hour hours week weeks later soon right now again still already never "
+  "always maybe probably actually really very much many more less should "
+  "need needs able check looks seems sounds great nice cool awesome "
+  "https://www. .com .org .net http:// ";
+
+// Read four bytes without worrying about alignment
+uint32_t lz_read32(char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write a length that didn't fit in its token nibble as a run of 255s
+char* lz_put_length(char* out, size_t len) {
+  while(len >= 255) {
+    *out++ = (char)255;
+    len -= 255;
+  }
+  *out++ = (char)len;
+  return out;
+}
+
+size_t lz_compress(char* src, size_t src_len, char* dst, size_t dst_cap) {
+  size_t dict_len = sizeof(lz_dictionary) - 1;
+  size_t end = dict_len + src_len;
+
+  // Matching runs over the dictionary followed by the input, as one buffer
+  char* buf = malloc(end);
+  memcpy(buf, lz_dictionary, dict_len);
+  memcpy(buf + dict_len, src, src_len);
+
+  int32_t table[1 << HASH_BITS];
+  memset(table, -1, sizeof(table));
+  for(size_t i = 0; i + MIN_MATCH <= dict_len; i++) {
+    table[lz_hash(lz_read32(buf + i))] = i;
+  }
+
+  char* out = dst;
+  char* out_end = dst + dst_cap;
+  size_t anchor = dict_len;
+  size_t pos = dict_len;
+  while(pos + MIN_MATCH <= end) {
+    uint32_t h = lz_hash(lz_read32(buf + pos));
+    int32_t candidate = table[h];
+    table[h] = pos;
+    if(candidate < 0 || pos - candidate > MAX_OFFSET ||
+       lz_read32(buf + candidate) != lz_read32(buf + pos)) {
+      pos++;
+      continue;
+    }
+
+    size_t match_len = MIN_MATCH;
+    while(pos + match_len < end && buf[candidate + match_len] == buf[pos + match_len]) {
+      match_len++;
+    }
+
+    // Token, literal run, offset, then any overflow of the match length
+    size_t literals = pos - anchor;
+    if(out + 1 + literals + literals / 255 + 1 + 2 + match_len / 255 + 1 > out_end) {
+      free(buf);
+      return 0;
+    }
+    char* token = out++;
+    *token = (char)((literals >= 15 ? 15 : literals) << 4);
+    if(literals >= 15) {
+      out = lz_put_length(out, literals - 15);
+    }
+    memcpy(out, buf + anchor, literals);
+    out += literals;
+
+    size_t offset = pos - candidate;
+    *out++ = (char)(offset & 0xff);
+    *out++ = (char)(offset >> 8);
+
+    size_t extra = match_len - MIN_MATCH;
+    *token |= (char)(extra >= 15 ? 15 : extra);
+    if(extra >= 15) {
+      out = lz_put_length(out, extra - 15);
+    }
+
+    pos += match_len;
+    anchor = pos;
+  }
+
+  // The last sequence is only literals, with no offset after them
+  size_t literals = end - anchor;
+  if(out + 1 + literals + literals / 255 + 1 > out_end) {
+    free(buf);
+    return 0;
+  }
+  char* token = out++;
+  *token = (char)((literals >= 15 ? 15 : literals) << 4);
+  if(literals >= 15) {
+    out = lz_put_length(out, literals - 15);
+  }
+  memcpy(out, buf + anchor, literals);
+  out += literals;
+
+  free(buf);
+  return out - dst;
+}
+
+// Read an overflowed length; returns -1 if the input runs out
+int lz_get_length(unsigned char* src, size_t src_len, size_t* ip, size_t* len) {
+  unsigned char b;
+  do {
+    if(*ip >= src_len) {
+      return -1;
+    }
+    b = src[(*ip)++];
+    *len += b;
+  } while(b == 255);
+  return 0;
+}
+
+int lz_decompress(char* src, size_t src_len, char* dst, size_t dst_len) {
+  unsigned char* in = (unsigned char*)src;
+  size_t dict_len = sizeof(lz_dictionary) - 1;
+  size_t end = dict_len + dst_len;
+
+  // Decode after a copy of the dictionary so matches can reach into it
+  char* buf = malloc(end);
+  memcpy(buf, lz_dictionary, dict_len);
+
+  size_t ip = 0;
+  size_t op = dict_len;
+  int result = -1;
+  while(ip < src_len) {
+    unsigned char token = in[ip++];
+
+    size_t literals = token >> 4;
+    if(literals == 15 && lz_get_length(in, src_len, &ip, &literals) == -1) {
+      goto done;
+    }
+    if(literals > src_len - ip || literals > end - op) {
+      goto done;
+    }
+    memcpy(buf + op, in + ip, literals);
+    ip += literals;
+    op += literals;
+
+    // The final sequence has no match
+    if(ip == src_len) {
+      break;
+    }
+
+    if(src_len - ip < 2) {
+      goto done;
+    }
+    size_t offset = in[ip] | (in[ip + 1] << 8);
+    ip += 2;
+    size_t match_len = token & 15;
+    if(match_len == 15 && lz_get_length(in, src_len, &ip, &match_len) == -1) {
+      goto done;
+    }
+    match_len += MIN_MATCH;
+    if(offset == 0 || offset > op || match_len > end - op) {
+      goto done;
+    }
+
+    // Copy a byte at a time since the match may overlap what it produces
+    for(size_t i = 0; i < match_len; i++) {
+      buf[op + i] = buf[op - offset + i];
+    }
+    op += match_len;
+  }
+
+  if(op == end) {
+    memcpy(dst, buf + dict_len, dst_len);
+    result = 0;
+  }
+done:
+  free(buf);
+  return result;
+}
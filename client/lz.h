@@ -0,0 +1,40 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/**
+ * A small LZ77 codec for chat payloads, in the style of LZ4's block format.
+ * Every block is compressed independently against a preset dictionary of
+ * common chat text that all peers share, so short messages still find
+ * matches and any peer can decode a block without per-link state.
+ */
+
+// Largest output lz_compress can produce for an input of n bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/**
+ * Compress a block.
+ *
+ * \param src      The bytes to compress.
+ * \param src_len  The number of bytes in src.
+ * \param dst      Receives the compressed block.
+ * \param dst_cap  Space in dst. LZ_BOUND(src_len) is always enough.
+ *
+ * \returns The compressed length, or 0 if it would not fit in dst_cap.
+ */
+size_t lz_compress(char* src, size_t src_len, char* dst, size_t dst_cap);
+
+/**
+ * Decompress a block. Malformed input is rejected rather than trusted.
+ *
+ * \param src      The compressed block.
+ * \param src_len  The number of bytes in src.
+ * \param dst      Receives the original bytes.
+ * \param dst_len  The exact original length.
+ *
+ * \returns 0 on success, or -1 if the block is malformed or the wrong length.
+ */
+int lz_decompress(char* src, size_t src_len, char* dst, size_t dst_len);
+
+#endif
@@ -0,0 +1,308 @@
+#include "order.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int64_t order_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+order_t* order_create(int mode, void (*deliver)(frame_t* frame)) {
+  order_t* order = calloc(1, sizeof(order_t));
+  order->mode = mode;
+  order->started = order_now_ms();
+  order->deliver = deliver;
+  pthread_mutex_init(&order->m, NULL);
+  return order;
+}
+
+// Find an origin's stream on a channel, adding it if it's new
+order_stream_t* order_find(order_t* order, uint32_t origin, uint32_t channel, bool create, bool* created) {
+  order_stream_t** bucket = &order->buckets[(origin ^ channel) % ORDER_BUCKETS];
+  for(order_stream_t* s = *bucket; s != NULL; s = s->next_in_bucket) {
+    if(s->origin == origin && s->channel == channel) {
+      *created = false;
+      return s;
+    }
+  }
+  if(!create) {
+    return NULL;
+  }
+  order_stream_t* s = calloc(1, sizeof(order_stream_t));
+  s->origin = origin;
+  s->channel = channel;
+  s->next_in_bucket = *bucket;
+  *bucket = s;
+  *created = true;
+  return s;
+}
+
+// Find a channel's record, adding it if it's new. Caller holds the lock.
+order_channel_t* order_channel(order_t* order, uint32_t channel) {
+  for(order_channel_t* c = order->channels; c != NULL; c = c->next) {
+    if(c->channel == channel) {
+      return c;
+    }
+  }
+  order_channel_t* c = calloc(1, sizeof(order_channel_t));
+  c->channel = channel;
+  c->next = order->channels;
+  order->channels = c;
+  return c;
+}
+
+void order_stamp(order_t* order, frame_t* frame) {
+  pthread_mutex_lock(&order->m);
+  order_channel_t* c = order_channel(order, frame->channel);
+  frame->order = c->sent++;
+  frame->flags |= FRAME_ORDERED;
+  if(order->mode == ORDER_CAUSAL && c->seen_count > 0) {
+    frame_add_dependencies(frame, c->seen, c->seen_count);
+  }
+  pthread_mutex_unlock(&order->m);
+}
+
+// Count a dependency as delivered, so nothing waits on it again. A message it names that
+// turns up later is delivered late, as one a stream gave up on is.
+void order_satisfy(order_t* order, uint32_t origin, uint32_t channel, uint16_t dep) {
+  bool created;
+  order_stream_t* s = order_find(order, origin, channel, true, &created);
+  // A stream holding frames moves past them as they're delivered or given up on
+  if(created || (s->held_count == 0 && (int16_t)(dep + 1 - s->next) > 0)) {
+    s->next = dep + 1;
+  }
+}
+
+// Whether the messages a frame depends on, if any, have been delivered
+bool order_ready(order_t* order, frame_t* frame) {
+  frame_dependency_t deps[FRAME_MAX_DEPENDENCIES];
+  int count = order->mode == ORDER_CAUSAL ? frame_dependencies(frame, deps) : 0;
+  for(int i = 0; i < count; i++) {
+    if(deps[i].origin == frame->origin) {
+      continue;
+    }
+    bool created;
+    order_stream_t* s = order_find(order, deps[i].origin, frame->channel, false, &created);
+    if(s == NULL) {
+      if(order_now_ms() - order->started < ORDER_JOIN_GRACE_MS) {
+        // Likely sent before we joined, so it will never come
+        order_satisfy(order, deps[i].origin, frame->channel, deps[i].order);
+        continue;
+      }
+      // Likely overtaken by this frame on its way
+      return false;
+    }
+    // Delivered once its stream has moved past it
+    if((int16_t)(s->next - deps[i].order) <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Remember a delivered message, to name in what we send next on its channel
+void order_seen(order_channel_t* c, frame_t* frame) {
+  int i = 0;
+  while(i < c->seen_count && c->seen[i].origin != frame->origin) {
+    i++;
+  }
+  if(i == c->seen_count && c->seen_count < FRAME_MAX_DEPENDENCIES) {
+    c->seen_count++;
+  } else if(i == c->seen_count) {
+    // The origin heard from longest ago drops out
+    i--;
+  }
+  memmove(&c->seen[1], &c->seen[0], i * sizeof(frame_dependency_t));
+  c->seen[0].origin = frame->origin;
+  c->seen[0].order = frame->order;
+}
+
+// Deliver the frame at the front of a stream
+void order_deliver(order_t* order, order_stream_t* s, frame_t* frame) {
+  s->next = frame->order + 1;
+  if(order->mode == ORDER_CAUSAL) {
+    // What we send on this channel next follows this
+    pthread_mutex_lock(&order->m);
+    order_seen(order_channel(order, frame->channel), frame);
+    pthread_mutex_unlock(&order->m);
+  }
+  order->deliver(frame);
+}
+
+// Take a held frame out of its slot
+frame_t* order_unhold(order_t* order, order_stream_t* s, frame_t** slot) {
+  frame_t* frame = *slot;
+  *slot = NULL;
+  s->held_count--;
+  order->held_total--;
+  return frame;
+}
+
+// Deliver the held frames at the front of a stream that are ready. Returns true if any were.
+bool order_drain(order_t* order, order_stream_t* s) {
+  bool progress = false;
+  while(s->held_count > 0) {
+    frame_t** slot = &s->held[s->next % ORDER_WINDOW];
+    if(*slot == NULL || (*slot)->order != s->next || !order_ready(order, *slot)) {
+      break;
+    }
+    frame_t* frame = order_unhold(order, s, slot);
+    order_deliver(order, s, frame);
+    frame_free(frame);
+    progress = true;
+  }
+  if(progress) {
+    // Whatever is still held waits afresh for the next gap
+    s->blocked_since = order_now_ms();
+  }
+  return progress;
+}
+
+// In causal mode, a delivery on one stream can unblock others that depend on it
+void order_pump(order_t* order) {
+  bool progress = true;
+  while(progress && order->held_total > 0) {
+    progress = false;
+    for(int b = 0; b < ORDER_BUCKETS; b++) {
+      for(order_stream_t* s = order->buckets[b]; s != NULL; s = s->next_in_bucket) {
+        if(s->held_count > 0 && order_drain(order, s)) {
+          progress = true;
+        }
+      }
+    }
+  }
+}
+
+// Give up on whatever is missing at the front of a stream, and deliver the first held frame
+void order_skip(order_t* order, order_stream_t* s) {
+  while(s->held[s->next % ORDER_WINDOW] == NULL) {
+    s->next++;
+  }
+  frame_t* frame = order_unhold(order, s, &s->held[s->next % ORDER_WINDOW]);
+  if(order->mode == ORDER_CAUSAL) {
+    // It may have been waiting on others, which its origin's later messages name too
+    frame_dependency_t deps[FRAME_MAX_DEPENDENCIES];
+    int count = frame_dependencies(frame, deps);
+    for(int i = 0; i < count; i++) {
+      if(deps[i].origin != frame->origin) {
+        order_satisfy(order, deps[i].origin, frame->channel, deps[i].order);
+      }
+    }
+  }
+  order_deliver(order, s, frame);
+  frame_free(frame);
+  order_drain(order, s);
+  s->blocked_since = order_now_ms();
+}
+
+void order_receive(order_t* order, frame_t* frame) {
+  if(order->mode == ORDER_NONE || !(frame->flags & FRAME_ORDERED)) {
+    order->deliver(frame);
+    return;
+  }
+  bool created;
+  order_stream_t* s = order_find(order, frame->origin, frame->channel, true, &created);
+  if(created) {
+    // We may have joined partway through; start with whatever comes first
+    s->next = frame->order;
+  }
+
+  int16_t ahead = (int16_t)(frame->order - s->next);
+  if(ahead < 0) {
+    // We already gave up waiting for it, so it's late but not lost
+    order->deliver(frame);
+    return;
+  }
+  if(ahead >= ORDER_WINDOW) {
+    // Too far ahead to hold: give up on the gap and start again from here
+    while(s->held_count > 0) {
+      order_skip(order, s);
+    }
+    s->next = frame->order;
+    ahead = 0;
+  }
+
+  // The fast path: it's next, and nothing is waiting on a gap
+  if(ahead == 0 && s->held_count == 0 && order_ready(order, frame)) {
+    order_deliver(order, s, frame);
+    if(order->held_total > 0 && order->mode == ORDER_CAUSAL) {
+      order_pump(order);
+    }
+    return;
+  }
+
+  frame_t** slot = &s->held[frame->order % ORDER_WINDOW];
+  if(*slot != NULL) {
+    // The same message twice, e.g. from an origin that restarted with our old id
+    order->deliver(frame);
+    return;
+  }
+  *slot = frame_retain(frame);
+  if(s->held_count++ == 0) {
+    s->blocked_since = order_now_ms();
+  }
+  order->held_total++;
+  if(order_drain(order, s) && order->mode == ORDER_CAUSAL) {
+    order_pump(order);
+  }
+}
+
+void order_expire(order_t* order) {
+  if(order->held_total == 0) {
+    return;
+  }
+  int64_t now = order_now_ms();
+  for(int b = 0; b < ORDER_BUCKETS; b++) {
+    for(order_stream_t* s = order->buckets[b]; s != NULL; s = s->next_in_bucket) {
+      if(s->held_count > 0 && now - s->blocked_since >= ORDER_HOLD_MS) {
+        order_skip(order, s);
+      }
+    }
+  }
+  if(order->mode == ORDER_CAUSAL) {
+    order_pump(order);
+  }
+}
+
+int order_wait_ms(order_t* order) {
+  if(order->held_total == 0) {
+    return -1;
+  }
+  int64_t now = order_now_ms();
+  int64_t wait = ORDER_HOLD_MS;
+  for(int b = 0; b < ORDER_BUCKETS; b++) {
+    for(order_stream_t* s = order->buckets[b]; s != NULL; s = s->next_in_bucket) {
+      if(s->held_count > 0 && s->blocked_since + ORDER_HOLD_MS - now < wait) {
+        wait = s->blocked_since + ORDER_HOLD_MS - now;
+      }
+    }
+  }
+  return wait < 0 ? 0 : wait;
+}
+
+void order_destroy(order_t* order) {
+  for(int b = 0; b < ORDER_BUCKETS; b++) {
+    order_stream_t* s = order->buckets[b];
+    while(s != NULL) {
+      order_stream_t* next = s->next_in_bucket;
+      for(int i = 0; i < ORDER_WINDOW; i++) {
+        if(s->held[i] != NULL) {
+          frame_free(s->held[i]);
+        }
+      }
+      free(s);
+      s = next;
+    }
+  }
+  order_channel_t* c = order->channels;
+  while(c != NULL) {
+    order_channel_t* next = c->next;
+    free(c);
+    c = next;
+  }
+  pthread_mutex_destroy(&order->m);
+  free(order);
+}
@@ -0,0 +1,122 @@
+#ifndef ORDER_H
+#define ORDER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+// How messages from each origin are shown
+#define ORDER_NONE 0     // As they arrive
+#define ORDER_FIFO 1     // In the order each origin sent them
+#define ORDER_CAUSAL 2   // FIFO, and never before a message its sender had seen
+
+// Messages held per stream waiting for a gap to fill
+#define ORDER_WINDOW 32
+// How long a stream waits for a missing message before giving up on it
+#define ORDER_HOLD_MS 500
+// For this long after we start, a message from an origin we've not heard from is taken as sent
+// before we joined, so nothing waits on it
+#define ORDER_JOIN_GRACE_MS 2000
+// Streams are spread over this many hash chains
+#define ORDER_BUCKETS 256
+
+/**
+ * One origin's messages on one channel. Each origin numbers its messages
+ * per channel, not overall, since a receiver only sees the channels it has
+ * joined and would otherwise find gaps that never fill.
+ *
+ * The next message is delivered straight away. One further ahead is held
+ * in its slot of the window until those before it arrive. If they haven't
+ * arrived after ORDER_HOLD_MS, or the window overflows, the stream gives up
+ * on them and carries on; a message that turns up after that is delivered
+ * late rather than lost.
+ */
+typedef struct order_stream {
+  uint32_t origin;
+  uint32_t channel;
+  uint16_t next;             // The order of the next message to deliver
+  frame_t* held[ORDER_WINDOW];
+  int held_count;
+  int64_t blocked_since;     // When the front of the stream last got stuck (ms)
+  struct order_stream* next_in_bucket;
+} order_stream_t;
+
+// What we've sent and seen on one channel, for stamping our own messages
+typedef struct order_channel {
+  uint32_t channel;
+  uint16_t sent;             // The order of our next message here
+  // The last message we showed here from each of the origins we showed most recently, newest first
+  frame_dependency_t seen[FRAME_MAX_DEPENDENCIES];
+  int seen_count;
+  struct order_channel* next;
+} order_channel_t;
+
+/**
+ * Puts received messages back in each origin's order before delivering
+ * them. Messages that arrive in order, or frames with no order, are
+ * delivered immediately; only a gap costs anything.
+ *
+ * In causal mode, each message we send also names the last message we
+ * showed on its channel from each of the FRAME_MAX_DEPENDENCIES origins we
+ * heard from most recently, and a receiver holds it until it has shown
+ * those too. So a reply never appears before what it answers, nor before
+ * what that answered, as long as the chain stays within that many of the
+ * channel's most recent speakers; older ones fall out of the set and are
+ * no longer waited for.
+ *
+ * A dependency that is given up on, because its wait ran out or because
+ * we'd only just joined and never heard from its origin, counts as shown
+ * from then on, so later messages naming it don't wait again.
+ *
+ * Receiving, delivering and expiring happen on one thread. Stamping may
+ * happen on any.
+ */
+typedef struct order {
+  int mode;
+  int64_t started;           // When we started (ms), for ORDER_JOIN_GRACE_MS
+  void (*deliver)(frame_t* frame);
+  order_stream_t* buckets[ORDER_BUCKETS];
+  int held_total;            // Messages held across every stream
+  pthread_mutex_t m;         // Guards channels
+  order_channel_t* channels;
+} order_t;
+
+/**
+ * Create an empty set of streams.
+ *
+ * \param mode     One of the ORDER_ modes.
+ * \param deliver  Called with each frame once it's its turn.
+ */
+order_t* order_create(int mode, void (*deliver)(frame_t* frame));
+
+/**
+ * Number a chat message we're about to send, and in causal mode name the
+ * message it follows.
+ */
+void order_stamp(order_t* order, frame_t* frame);
+
+/**
+ * Deliver a received frame, or hold it until its turn. The frame is not
+ * owned by this function; a held frame is retained.
+ */
+void order_receive(order_t* order, frame_t* frame);
+
+/**
+ * Deliver what has waited too long on a gap.
+ */
+void order_expire(order_t* order);
+
+/**
+ * \returns How many milliseconds until order_expire has something to do,
+ *          or -1 if nothing is held.
+ */
+int order_wait_ms(order_t* order);
+
+/**
+ * Free the streams, and any frames still held, without delivering them.
+ */
+void order_destroy(order_t* order);
+
+#endif
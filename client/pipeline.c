@@ -0,0 +1,200 @@
+#include "pipeline.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// A frame on its way through the pipeline, and the link it came in on (NULL for one of ours)
+typedef struct pipeline_item {
+  frame_t* frame;
+  link_t* from;
+} pipeline_item_t;
+
+void pipeline_inbox_init(pipeline_inbox_t* inbox, bool shared, size_t capacity) {
+  inbox->shared = shared ? ring_create(capacity) : NULL;
+  inbox->own = shared ? NULL : spsc_create(capacity);
+  if(inbox->shared == NULL && inbox->own == NULL) {
+    fprintf(stderr, "Failed to allocate pipeline queue\n");
+    exit(EXIT_FAILURE);
+  }
+  atomic_init(&inbox->sleeping, false);
+  pthread_mutex_init(&inbox->m, NULL);
+  pthread_cond_init(&inbox->wake, NULL);
+}
+
+// Take the next item if there is one
+pipeline_item_t* pipeline_poll(pipeline_inbox_t* inbox) {
+  return inbox->shared != NULL ? ring_pop(inbox->shared) : spsc_pop(inbox->own);
+}
+
+// Take the next item, sleeping until there is one or timeout_ms passes (-1 to wait for good)
+pipeline_item_t* pipeline_take(pipeline_inbox_t* inbox, int timeout_ms) {
+  pipeline_item_t* item = pipeline_poll(inbox);
+  if(item != NULL || timeout_ms == 0) {
+    return item;
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&inbox->m);
+  atomic_store(&inbox->sleeping, true);
+  // Look again with the flag up, or an item added just before it went up would be missed
+  while((item = pipeline_poll(inbox)) == NULL) {
+    if(timeout_ms < 0) {
+      pthread_cond_wait(&inbox->wake, &inbox->m);
+    } else if(pthread_cond_timedwait(&inbox->wake, &inbox->m, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  atomic_store(&inbox->sleeping, false);
+  pthread_mutex_unlock(&inbox->m);
+  return item;
+}
+
+// Add an item, waking the stage if it's asleep
+void pipeline_give(pipeline_inbox_t* inbox, pipeline_item_t* item) {
+  while(!(inbox->shared != NULL ? ring_push(inbox->shared, item) : spsc_push(inbox->own, item))) {
+    usleep(PIPELINE_FULL_WAIT_US);
+  }
+  if(atomic_load(&inbox->sleeping)) {
+    pthread_mutex_lock(&inbox->m);
+    pthread_cond_signal(&inbox->wake);
+    pthread_mutex_unlock(&inbox->m);
+  }
+}
+
+void pipeline_item_free(pipeline_t* pipeline, pipeline_item_t* item) {
+  frame_free(item->frame);
+  if(item->from != NULL) {
+    link_release(item->from);
+  }
+  free(item);
+  atomic_fetch_sub(&pipeline->pending, 1);
+}
+
+void* pipeline_decode_fn(void* p) {
+  pipeline_t* pipeline = (pipeline_t*)p;
+  order_t* order = pipeline->order;
+  while(true) {
+    // Messages held for a gap must be let go when it times out, even if nothing else arrives
+    int timeout_ms = order == NULL ? -1 : order_wait_ms(order);
+    pipeline_item_t* item = pipeline_take(&pipeline->decode, timeout_ms);
+    if(item != NULL) {
+      frame_t* frame = item->frame;
+      // A reshaping tree can deliver a frame twice, or bring one of ours back to us; only the
+      // first copy goes anywhere, and ours are only noted, since relay_frame sends them itself
+      if(dedup_first(pipeline->dedup, frame->origin, frame->seq) && item->from != NULL) {
+        atomic_fetch_add(&pipeline->pending, pipeline->shards);
+        for(int s = 0; s < pipeline->shards; s++) {
+          pipeline_item_t* copy = malloc(sizeof(pipeline_item_t));
+          copy->frame = frame_retain(frame);
+          copy->from = link_retain(item->from);
+          pipeline_give(&pipeline->shard[s].inbox, copy);
+        }
+        if(order != NULL) {
+          order_receive(order, frame);
+        } else {
+          pipeline->deliver(frame);
+        }
+      }
+      pipeline_item_free(pipeline, item);
+    }
+    if(order != NULL) {
+      order_expire(order);
+    }
+  }
+  return NULL;
+}
+
+void* pipeline_shard_fn(void* p) {
+  pipeline_shard_t* shard = (pipeline_shard_t*)p;
+  pipeline_t* pipeline = shard->pipeline;
+  while(true) {
+    pipeline_item_t* item = pipeline_take(&shard->inbox, -1);
+    // Send everything waiting as one batch, so the links' writers see it all at once
+    link_batch_begin();
+    do {
+      pipeline->fan_out(item->frame, item->from, shard->index);
+      pipeline_item_free(pipeline, item);
+    } while((item = pipeline_poll(&shard->inbox)) != NULL);
+    link_batch_end();
+  }
+  return NULL;
+}
+
+// Start a detached pipeline thread
+void pipeline_start(void* (*fn)(void*), void* arg) {
+  pthread_t thread;
+  if(pthread_create(&thread, NULL, fn, arg)) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+}
+
+pipeline_t* pipeline_create(int shards, void (*fan_out)(frame_t* frame, link_t* from, int shard),
+                            void (*deliver)(frame_t* frame), order_t* order) {
+  if(shards < 1) {
+    shards = 1;
+  } else if(shards > PIPELINE_MAX_SHARDS) {
+    shards = PIPELINE_MAX_SHARDS;
+  }
+  pipeline_t* pipeline = malloc(sizeof(pipeline_t));
+  pipeline->shards = shards;
+  pipeline->fan_out = fan_out;
+  pipeline->deliver = deliver;
+  pipeline->dedup = dedup_create();
+  pipeline->order = order;
+  atomic_init(&pipeline->next_shard, 0);
+  atomic_init(&pipeline->pending, 0);
+  pipeline_inbox_init(&pipeline->decode, true, PIPELINE_DECODE_CAPACITY);
+  for(int s = 0; s < shards; s++) {
+    pipeline->shard[s].pipeline = pipeline;
+    pipeline->shard[s].index = s;
+    pipeline_inbox_init(&pipeline->shard[s].inbox, false, PIPELINE_SHARD_CAPACITY);
+  }
+
+  pipeline_start(pipeline_decode_fn, pipeline);
+  for(int s = 0; s < shards; s++) {
+    pipeline_start(pipeline_shard_fn, &pipeline->shard[s]);
+  }
+  return pipeline;
+}
+
+int pipeline_assign(pipeline_t* pipeline) {
+  return atomic_fetch_add(&pipeline->next_shard, 1) % pipeline->shards;
+}
+
+void pipeline_submit(pipeline_t* pipeline, frame_t* frame, link_t* from) {
+  pipeline_item_t* item = malloc(sizeof(pipeline_item_t));
+  item->frame = frame;
+  item->from = link_retain(from);
+  atomic_fetch_add(&pipeline->pending, 1);
+  pipeline_give(&pipeline->decode, item);
+}
+
+void pipeline_record(pipeline_t* pipeline, frame_t* frame) {
+  pipeline_item_t* item = malloc(sizeof(pipeline_item_t));
+  item->frame = frame_retain(frame);
+  item->from = NULL;
+  atomic_fetch_add(&pipeline->pending, 1);
+  pipeline_give(&pipeline->decode, item);
+}
+
+int pipeline_drain(pipeline_t* pipeline, int timeout_ms) {
+  for(int waited = 0; atomic_load(&pipeline->pending) > 0; waited++) {
+    if(waited * PIPELINE_DRAIN_POLL_MS >= timeout_ms) {
+      return -1;
+    }
+    usleep(PIPELINE_DRAIN_POLL_MS * 1000);
+  }
+  return 0;
+}
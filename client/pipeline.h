@@ -0,0 +1,124 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "dedup.h"
+#include "frame.h"
+#include "link.h"
+#include "order.h"
+#include "ring.h"
+
+// The most fan-out workers a pipeline can have
+#define PIPELINE_MAX_SHARDS 16
+// Frames waiting for the decode stage, and for each fan-out worker
+#define PIPELINE_DECODE_CAPACITY 4096
+#define PIPELINE_SHARD_CAPACITY 1024
+// How long a producer sleeps before trying a full queue again
+#define PIPELINE_FULL_WAIT_US 100
+// How often pipeline_drain looks to see whether the pipeline has emptied
+#define PIPELINE_DRAIN_POLL_MS 5
+
+/**
+ * A stage's input: a lock-free queue, and a way for the stage to sleep once
+ * it's empty. Producers only take the lock when the stage is asleep, so a
+ * busy stage is fed without any locking at all.
+ */
+typedef struct pipeline_inbox {
+  ring_t* shared;          // Fed by any number of threads, or
+  spsc_t* own;             // fed by exactly one
+  atomic_bool sleeping;
+  pthread_mutex_t m;
+  pthread_cond_t wake;
+} pipeline_inbox_t;
+
+typedef struct pipeline pipeline_t;
+
+// A fan-out worker and the frames waiting for it
+typedef struct pipeline_shard {
+  pipeline_t* pipeline;
+  int index;
+  pipeline_inbox_t inbox;
+} pipeline_shard_t;
+
+/**
+ * Relaying runs in stages, so it scales with cores instead of being done
+ * start to finish by the thread that read each frame:
+ *
+ *  1. Each link's thread reads frames and submits them.
+ *  2. One decode stage drops duplicates, hands each frame to every fan-out
+ *     worker, then delivers it here (history, UI, transfers), putting
+ *     messages back in order first if asked to.
+ *  3. Fan-out workers each send to their own share of the neighbors, every
+ *     frame they find waiting in one batch.
+ *
+ * Stages are joined by lock-free queues: many to one into the decode stage,
+ * one to one from it to each worker. A frame from one link reaches each
+ * neighbor in the order it was read.
+ */
+struct pipeline {
+  int shards;
+  void (*fan_out)(frame_t* frame, link_t* from, int shard);
+  void (*deliver)(frame_t* frame);
+  dedup_t* dedup;          // Only touched by the decode stage
+  order_t* order;          // Receiving and expiring only happen on the decode stage
+  pipeline_inbox_t decode;
+  pipeline_shard_t shard[PIPELINE_MAX_SHARDS];
+  atomic_uint next_shard;
+  atomic_int pending;      // Items submitted or copied to a worker and not yet freed
+};
+
+/**
+ * Create a pipeline and start its threads.
+ *
+ * \param shards   The number of fan-out workers, up to PIPELINE_MAX_SHARDS.
+ * \param fan_out  Called on a worker to send a frame to that worker's share
+ *                 of the neighbors, skipping the one it came from.
+ * \param deliver  Called on the decode stage to handle a frame ourselves,
+ *                 once it has been handed to the workers.
+ * \param order    If not NULL, frames are delivered through it instead, so
+ *                 messages are shown in order. Its deliver should be the
+ *                 same function.
+ *
+ * \returns The pipeline. Exits if its threads can't be started.
+ */
+pipeline_t* pipeline_create(int shards, void (*fan_out)(frame_t* frame, link_t* from, int shard),
+                            void (*deliver)(frame_t* frame), order_t* order);
+
+/**
+ * Pick the fan-out worker for a new neighbor, spreading neighbors evenly.
+ */
+int pipeline_assign(pipeline_t* pipeline);
+
+/**
+ * Hand a received frame to the pipeline. Waits only if the decode stage is
+ * hopelessly behind; credit normally keeps it from getting there.
+ *
+ * \param frame  The frame. The pipeline takes over the caller's reference.
+ * \param from   The link it came from. The pipeline takes its own reference.
+ */
+void pipeline_submit(pipeline_t* pipeline, frame_t* frame, link_t* from);
+
+/**
+ * Note a frame we created before sending it, so a copy that comes back to us
+ * while the tree reshapes is dropped as a duplicate rather than shown and
+ * relayed again. It goes through the decode stage like a received frame, so
+ * it's noted before any copy that arrives after it.
+ *
+ * \param frame  The frame. Not owned by this function.
+ */
+void pipeline_record(pipeline_t* pipeline, frame_t* frame);
+
+/**
+ * Wait until every frame submitted so far has been delivered and handed to
+ * every neighbor's link.
+ *
+ * \param timeout_ms  The longest to wait.
+ *
+ * \returns 0 once the pipeline is empty, -1 if it timed out first.
+ */
+int pipeline_drain(pipeline_t* pipeline, int timeout_ms);
+
+#endif
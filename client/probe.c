@@ -0,0 +1,127 @@
+#include "probe.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame.h"
+
+// Where each probe is in its exchange
+#define PROBE_CONNECTING 0
+#define PROBE_WAITING 1
+#define PROBE_DONE 2
+
+int64_t probe_now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Start a non-blocking connect; returns the socket or -1
+int probe_start(probe_t* probe) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd == -1) {
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  if(connect(fd, (struct sockaddr*)&probe->addr, sizeof(struct sockaddr_in)) == -1 &&
+     errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void probe_rtt(probe_t* probes, int count, int timeout_ms) {
+  struct pollfd* fds = malloc(sizeof(struct pollfd) * count);
+  int* state = malloc(sizeof(int) * count);
+  unsigned char (*replies)[FRAME_HEADER_SIZE + 4] = malloc((FRAME_HEADER_SIZE + 4) * count);
+  size_t* received = calloc(count, sizeof(size_t));
+
+  int64_t start = probe_now_us();
+  int64_t deadline = start + (int64_t)timeout_ms * 1000;
+  int pending = 0;
+  for(int i = 0; i < count; i++) {
+    probes[i].rtt_us = -1;
+    probes[i].spare = 0;
+    fds[i].fd = probe_start(&probes[i]);
+    fds[i].events = POLLOUT;
+    state[i] = fds[i].fd == -1 ? PROBE_DONE : PROBE_CONNECTING;
+    if(fds[i].fd != -1) {
+      pending++;
+    }
+  }
+
+  unsigned char ping[FRAME_HEADER_SIZE];
+  frame_t header = { .type = FRAME_PING };
+  frame_encode_header(&header, ping);
+
+  while(pending > 0) {
+    int64_t now = probe_now_us();
+    if(now >= deadline) {
+      break;
+    }
+    if(poll(fds, count, (deadline - now + 999) / 1000) <= 0) {
+      continue;
+    }
+
+    for(int i = 0; i < count; i++) {
+      if(state[i] == PROBE_DONE || fds[i].revents == 0) {
+        continue;
+      }
+      bool failed = (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) && !(fds[i].revents & POLLIN);
+
+      if(!failed && state[i] == PROBE_CONNECTING) {
+        // Connected; ask how much room it has
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if(error != 0 || send(fds[i].fd, ping, FRAME_HEADER_SIZE, MSG_NOSIGNAL) != FRAME_HEADER_SIZE) {
+          failed = true;
+        } else {
+          state[i] = PROBE_WAITING;
+          fds[i].events = POLLIN;
+        }
+      } else if(!failed && state[i] == PROBE_WAITING) {
+        ssize_t n = recv(fds[i].fd, replies[i] + received[i], FRAME_HEADER_SIZE + 4 - received[i], 0);
+        if(n <= 0) {
+          failed = true;
+        } else if((received[i] += n) == FRAME_HEADER_SIZE + 4) {
+          // The PONG's payload is its spare capacity
+          uint32_t spare;
+          memcpy(&spare, replies[i] + FRAME_HEADER_SIZE, 4);
+          if(replies[i][0] == FRAME_PONG) {
+            probes[i].rtt_us = probe_now_us() - start;
+            probes[i].spare = ntohl(spare);
+          }
+          state[i] = PROBE_DONE;
+        }
+      }
+
+      if(failed || state[i] == PROBE_DONE) {
+        state[i] = PROBE_DONE;
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        pending--;
+      }
+    }
+  }
+
+  // Give up on anything that didn't answer in time
+  for(int i = 0; i < count; i++) {
+    if(state[i] != PROBE_DONE) {
+      close(fds[i].fd);
+    }
+  }
+  free(fds);
+  free(state);
+  free(replies);
+  free(received);
+}
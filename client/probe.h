@@ -0,0 +1,30 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+/**
+ * Measure how far away some would-be parents are. Every target is probed at
+ * once: a non-blocking connect, then a PING frame that the peer answers with
+ * a PONG saying how many more children it will take. The time from starting
+ * the connect to reading the PONG is the target's round-trip time, so the
+ * whole probe costs about as long as the slowest answer we're willing to
+ * wait for.
+ */
+typedef struct probe {
+  struct sockaddr_in addr;
+  int64_t rtt_us;   // -1 if it didn't answer in time
+  int spare;        // Children it has room for
+} probe_t;
+
+/**
+ * Probe every target in parallel and fill in rtt_us and spare.
+ *
+ * \param probes      The targets, with addr filled in.
+ * \param count       The number of targets.
+ * \param timeout_ms  How long to wait for the slowest answer.
+ */
+void probe_rtt(probe_t* probes, int count, int timeout_ms);
+
+#endif
@@ -0,0 +1,154 @@
+#include "race.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame.h"
+
+// Where each attempt is in its handshake
+#define RACE_IDLE 0
+#define RACE_CONNECTING 1
+#define RACE_WAITING 2
+#define RACE_FAILED 3
+
+// A HELLO is a header and 4 bytes of capabilities
+#define HELLO_SIZE (FRAME_HEADER_SIZE + 4)
+
+int64_t race_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int race_connect(struct sockaddr_in* addrs, int count, uint32_t offered, uint32_t* agreed, int* winner) {
+  struct pollfd* fds = malloc(sizeof(struct pollfd) * (count + 1));
+  int* state = calloc(count + 1, sizeof(int));
+  unsigned char (*replies)[HELLO_SIZE] = malloc(HELLO_SIZE * (count + 1));
+  size_t* received = calloc(count + 1, sizeof(size_t));
+  for(int i = 0; i < count; i++) {
+    fds[i].fd = -1;
+    fds[i].events = 0;
+  }
+
+  unsigned char hello[HELLO_SIZE];
+  frame_t header = { .type = FRAME_HELLO, .length = 4 };
+  frame_encode_header(&header, hello);
+  uint32_t caps = htonl(offered);
+  memcpy(hello + FRAME_HEADER_SIZE, &caps, 4);
+
+  int64_t deadline = race_now_ms() + RACE_DEADLINE_MS;
+  int64_t next_start = race_now_ms();
+  int started = 0;
+  int in_flight = 0;
+  int result = -1;
+
+  while(result == -1 && (started < count || in_flight > 0)) {
+    int64_t now = race_now_ms();
+    if(now >= deadline) {
+      break;
+    }
+
+    // Start the next candidate when its turn comes, or right away if nothing is in flight
+    if(started < count && (now >= next_start || in_flight == 0)) {
+      int i = started++;
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      if(fd != -1) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if(connect(fd, (struct sockaddr*)&addrs[i], sizeof(struct sockaddr_in)) == -1 &&
+           errno != EINPROGRESS) {
+          close(fd);
+          fd = -1;
+        }
+      }
+      if(fd == -1) {
+        state[i] = RACE_FAILED;
+      } else {
+        fds[i].fd = fd;
+        fds[i].events = POLLOUT;
+        state[i] = RACE_CONNECTING;
+        in_flight++;
+      }
+      next_start = now + RACE_STAGGER_MS;
+      continue;
+    }
+
+    // Wait for progress, or until the next candidate is due
+    int64_t wake = deadline;
+    if(started < count && next_start < wake) {
+      wake = next_start;
+    }
+    if(poll(fds, started, wake > now ? wake - now : 0) <= 0) {
+      continue;
+    }
+
+    for(int i = 0; i < started && result == -1; i++) {
+      if(fds[i].fd == -1 || fds[i].revents == 0) {
+        continue;
+      }
+      bool failed = (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) && !(fds[i].revents & POLLIN);
+
+      if(!failed && state[i] == RACE_CONNECTING) {
+        // Connected; offer our capabilities
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if(error != 0 || send(fds[i].fd, hello, HELLO_SIZE, MSG_NOSIGNAL) != HELLO_SIZE) {
+          failed = true;
+        } else {
+          state[i] = RACE_WAITING;
+          fds[i].events = POLLIN;
+        }
+      } else if(!failed && state[i] == RACE_WAITING) {
+        // Read no further than the HELLO; whatever follows belongs to the link
+        ssize_t n = recv(fds[i].fd, replies[i] + received[i], HELLO_SIZE - received[i], 0);
+        if(n <= 0) {
+          failed = true;
+        } else if((received[i] += n) == HELLO_SIZE) {
+          frame_t* reply = frame_decode_header(replies[i]);
+          if(reply == NULL || reply->type != FRAME_HELLO || reply->length != 4) {
+            failed = true;
+          } else {
+            memcpy(&caps, replies[i] + FRAME_HEADER_SIZE, 4);
+            *agreed = ntohl(caps) & offered;
+            *winner = i;
+            result = fds[i].fd;
+            fds[i].fd = -1;
+          }
+          frame_free(reply);
+        }
+      }
+
+      if(failed) {
+        state[i] = RACE_FAILED;
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        in_flight--;
+        // Don't make the next candidate wait on one that's already gone
+        next_start = race_now_ms();
+      }
+    }
+  }
+
+  // Abandon every attempt that didn't win
+  for(int i = 0; i < started; i++) {
+    if(fds[i].fd != -1) {
+      close(fds[i].fd);
+    }
+  }
+  if(result != -1) {
+    fcntl(result, F_SETFL, fcntl(result, F_GETFL) & ~O_NONBLOCK);
+  }
+  free(fds);
+  free(state);
+  free(replies);
+  free(received);
+  return result;
+}
@@ -0,0 +1,33 @@
+#ifndef RACE_H
+#define RACE_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+/**
+ * Join a parent by racing connections to several candidates, Happy
+ * Eyeballs style. Candidates are started in order, each RACE_STAGGER_MS
+ * after the last or as soon as every attempt in flight has failed, so a
+ * dead candidate costs at most one stagger rather than a TCP timeout.
+ * The first candidate to finish the HELLO handshake wins and every other
+ * attempt is abandoned.
+ */
+#define RACE_STAGGER_MS 250
+// The longest a whole race may take, however many candidates are in it
+#define RACE_DEADLINE_MS 3000
+
+/**
+ * Race connections to some candidates.
+ *
+ * \param addrs   The candidates, best first.
+ * \param count   The number of candidates.
+ * \param offered The capabilities we offer in our HELLO.
+ * \param agreed  Receives the capabilities the winner agreed to.
+ * \param winner  Receives the index of the winning candidate.
+ *
+ * \returns The winner's connected, blocking socket, or -1 if no candidate
+ *          completed the handshake before the deadline.
+ */
+int race_connect(struct sockaddr_in* addrs, int count, uint32_t offered, uint32_t* agreed, int* winner);
+
+#endif
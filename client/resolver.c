@@ -0,0 +1,209 @@
+#include "resolver.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Find a name's entry. Caller holds the lock.
+resolver_entry_t* resolver_find(resolver_t* resolver, char* host) {
+  for(resolver_entry_t* entry = resolver->entries; entry != NULL; entry = entry->next) {
+    if(strcmp(entry->host, host) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// Add an empty entry for a name. Caller holds the lock.
+resolver_entry_t* resolver_add(resolver_t* resolver, char* host) {
+  resolver_entry_t* entry = calloc(1, sizeof(resolver_entry_t));
+  entry->host = strdup(host);
+  entry->next = resolver->entries;
+  resolver->entries = entry;
+  return entry;
+}
+
+// Hand a name to the workers unless one already has it. Caller holds the lock.
+void resolver_queue(resolver_t* resolver, resolver_entry_t* entry) {
+  if(entry->pending) {
+    return;
+  }
+  entry->pending = true;
+  entry->next_pending = resolver->queue;
+  resolver->queue = entry;
+  pthread_cond_signal(&resolver->work);
+}
+
+// Whether an entry needs looking up again. Caller holds the lock.
+bool resolver_stale(resolver_entry_t* entry) {
+  return entry->expires != 0 && time(NULL) >= entry->expires;
+}
+
+void* resolver_worker_fn(void* p) {
+  resolver_t* resolver = (resolver_t*)p;
+  pthread_mutex_lock(&resolver->m);
+  while(true) {
+    while(resolver->queue == NULL && !resolver->stopping) {
+      pthread_cond_wait(&resolver->work, &resolver->m);
+    }
+    if(resolver->stopping) {
+      break;
+    }
+    resolver_entry_t* entry = resolver->queue;
+    resolver->queue = entry->next_pending;
+
+    // Entries are never freed while workers run, so the name stays valid unlocked
+    pthread_mutex_unlock(&resolver->m);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* info = NULL;
+    int result = getaddrinfo(entry->host, NULL, &hints, &info);
+    pthread_mutex_lock(&resolver->m);
+
+    if(result == 0 && info != NULL) {
+      entry->addr = ((struct sockaddr_in*)info->ai_addr)->sin_addr;
+      entry->found = true;
+      entry->expires = time(NULL) + RESOLVER_TTL;
+    } else if(!entry->found) {
+      entry->expires = time(NULL) + RESOLVER_NEGATIVE_TTL;
+    }
+    if(info != NULL) {
+      freeaddrinfo(info);
+    }
+    entry->pending = false;
+    pthread_cond_broadcast(&resolver->done);
+  }
+  pthread_mutex_unlock(&resolver->m);
+  return NULL;
+}
+
+// Load "address name..." lines into entries that never expire
+void resolver_load_hosts(resolver_t* resolver, char* path) {
+  FILE* hosts = fopen(path, "r");
+  if(hosts == NULL) {
+    perror("Unable to open hosts file");
+    return;
+  }
+  char* line = NULL;
+  size_t linecap = 0;
+  while(getline(&line, &linecap, hosts) > 0) {
+    line[strcspn(line, "#")] = '\0';
+    char* address = strtok(line, " \t\n");
+    struct in_addr addr;
+    if(address == NULL || inet_pton(AF_INET, address, &addr) != 1) {
+      continue;
+    }
+    char* name;
+    while((name = strtok(NULL, " \t\n")) != NULL) {
+      resolver_entry_t* entry = resolver_find(resolver, name);
+      if(entry == NULL) {
+        entry = resolver_add(resolver, name);
+      }
+      entry->addr = addr;
+      entry->found = true;
+      entry->expires = 0;
+    }
+  }
+  free(line);
+  fclose(hosts);
+}
+
+resolver_t* resolver_create(int workers, char* hosts_path) {
+  resolver_t* resolver = malloc(sizeof(resolver_t));
+  pthread_mutex_init(&resolver->m, NULL);
+  pthread_cond_init(&resolver->work, NULL);
+  pthread_cond_init(&resolver->done, NULL);
+  resolver->entries = NULL;
+  resolver->queue = NULL;
+  resolver->stopping = false;
+  if(hosts_path != NULL) {
+    resolver_load_hosts(resolver, hosts_path);
+  }
+
+  resolver->workers = workers;
+  resolver->threads = malloc(sizeof(pthread_t) * workers);
+  for(int i = 0; i < workers; i++) {
+    if(pthread_create(&resolver->threads[i], NULL, resolver_worker_fn, resolver)) {
+      perror("pthread_create failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return resolver;
+}
+
+void resolver_prefetch(resolver_t* resolver, char* host) {
+  struct in_addr addr;
+  if(inet_pton(AF_INET, host, &addr) == 1) {
+    return;
+  }
+  pthread_mutex_lock(&resolver->m);
+  resolver_entry_t* entry = resolver_find(resolver, host);
+  if(entry == NULL) {
+    entry = resolver_add(resolver, host);
+  }
+  if(entry->expires == 0 ? !entry->found : resolver_stale(entry)) {
+    resolver_queue(resolver, entry);
+  }
+  pthread_mutex_unlock(&resolver->m);
+}
+
+bool resolver_lookup(resolver_t* resolver, char* host, struct in_addr* addr, int timeout_ms) {
+  // Dotted quads need no lookup at all
+  if(inet_pton(AF_INET, host, addr) == 1) {
+    return true;
+  }
+
+  resolver_prefetch(resolver, host);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if(deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&resolver->m);
+  resolver_entry_t* entry = resolver_find(resolver, host);
+  // A stale answer is served while it's refreshed; only a name we've never found waits
+  while(!entry->found && entry->pending) {
+    if(pthread_cond_timedwait(&resolver->done, &resolver->m, &deadline) != 0) {
+      break;
+    }
+  }
+  bool found = entry->found;
+  if(found) {
+    *addr = entry->addr;
+  }
+  pthread_mutex_unlock(&resolver->m);
+  return found;
+}
+
+void resolver_destroy(resolver_t* resolver) {
+  pthread_mutex_lock(&resolver->m);
+  resolver->stopping = true;
+  pthread_cond_broadcast(&resolver->work);
+  pthread_mutex_unlock(&resolver->m);
+  for(int i = 0; i < resolver->workers; i++) {
+    pthread_join(resolver->threads[i], NULL);
+  }
+  free(resolver->threads);
+
+  resolver_entry_t* entry = resolver->entries;
+  while(entry != NULL) {
+    resolver_entry_t* next = entry->next;
+    free(entry->host);
+    free(entry);
+    entry = next;
+  }
+  pthread_cond_destroy(&resolver->work);
+  pthread_cond_destroy(&resolver->done);
+  pthread_mutex_destroy(&resolver->m);
+  free(resolver);
+}
@@ -0,0 +1,80 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+
+// How long a looked-up address is trusted, and how long a failed lookup is remembered
+#define RESOLVER_TTL 300
+#define RESOLVER_NEGATIVE_TTL 10
+
+/**
+ * Host names are looked up by a small pool of worker threads calling
+ * getaddrinfo, so a slow DNS server holds up no one but the caller that
+ * needs the answer, and only for as long as it's willing to wait. Answers
+ * are cached for RESOLVER_TTL seconds. Once an answer is that old it's
+ * still handed out while a worker looks the name up again.
+ *
+ * Dotted quads never reach the workers. Names listed in a hosts file
+ * ("address name..." per line, as in /etc/hosts) are answered from it and
+ * never expire, which makes a stand-in for DNS when testing.
+ */
+typedef struct resolver_entry {
+  char* host;
+  struct in_addr addr;
+  bool found;           // Whether addr holds an answer, even a stale one
+  bool pending;         // Whether a worker is looking it up
+  time_t expires;       // 0 for hosts file entries, which never expire
+  struct resolver_entry* next;
+  struct resolver_entry* next_pending;
+} resolver_entry_t;
+
+typedef struct resolver {
+  pthread_mutex_t m;
+  pthread_cond_t work;   // Signaled when a lookup is queued
+  pthread_cond_t done;   // Broadcast when a lookup finishes
+  resolver_entry_t* entries;
+  resolver_entry_t* queue;
+  bool stopping;
+  int workers;
+  pthread_t* threads;
+} resolver_t;
+
+/**
+ * Start a resolver.
+ *
+ * \param workers     The number of lookups that can run at once.
+ * \param hosts_path  A hosts file to answer from first, or NULL for none.
+ *                    This function does *not* take ownership of this memory.
+ *
+ * \returns The resolver. Exits if its threads can't be started.
+ */
+resolver_t* resolver_create(int workers, char* hosts_path);
+
+/**
+ * Start looking a name up without waiting for the answer, e.g. for a
+ * connection we'll make shortly.
+ *
+ * \param host  Not owned by this function.
+ */
+void resolver_prefetch(resolver_t* resolver, char* host);
+
+/**
+ * Look a name up. Safe to call from any thread.
+ *
+ * \param host        A dotted quad or a host name. Not owned by this function.
+ * \param addr        Receives the address.
+ * \param timeout_ms  The longest to wait for a worker's answer.
+ *
+ * \returns true if an address was found in time.
+ */
+bool resolver_lookup(resolver_t* resolver, char* host, struct in_addr* addr, int timeout_ms);
+
+/**
+ * Stop the workers, waiting for lookups in progress, and free the resolver.
+ */
+void resolver_destroy(resolver_t* resolver);
+
+#endif
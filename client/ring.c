@@ -0,0 +1,144 @@
+#include "ring.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+ring_t* ring_create(size_t capacity) {
+  // The index mask only works for powers of two
+  if(capacity < 2 || (capacity & (capacity - 1)) != 0) {
+    return NULL;
+  }
+
+  ring_t* ring = aligned_alloc(64, sizeof(ring_t));
+  if(ring == NULL) {
+    return NULL;
+  }
+  ring->slots = malloc(sizeof(ring_slot_t) * capacity);
+  if(ring->slots == NULL) {
+    free(ring);
+    return NULL;
+  }
+  ring->mask = capacity - 1;
+
+  // Slot i is ready for the producer that claims position i
+  for(size_t i = 0; i < capacity; i++) {
+    atomic_init(&ring->slots[i].seq, i);
+    ring->slots[i].item = NULL;
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  return ring;
+}
+
+bool ring_push(ring_t* ring, void* item) {
+  size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  while(true) {
+    ring_slot_t* slot = &ring->slots[pos & ring->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if(diff == 0) {
+      // The slot is free; try to claim it
+      if(atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed)) {
+        slot->item = item;
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if(diff < 0) {
+      // The consumer hasn't emptied this slot yet, so the ring is full
+      return false;
+    } else {
+      // Another producer got here first
+      pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
+  }
+}
+
+void* ring_pop(ring_t* ring) {
+  size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while(true) {
+    ring_slot_t* slot = &ring->slots[pos & ring->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if(diff == 0) {
+      if(atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                               memory_order_relaxed, memory_order_relaxed)) {
+        void* item = slot->item;
+        // Hand the slot back to the producer one lap ahead
+        atomic_store_explicit(&slot->seq, pos + ring->mask + 1, memory_order_release);
+        return item;
+      }
+    } else if(diff < 0) {
+      // Nothing has been published here yet
+      return NULL;
+    } else {
+      pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    }
+  }
+}
+
+void ring_destroy(ring_t* ring) {
+  if(ring == NULL) {
+    return;
+  }
+  free(ring->slots);
+  free(ring);
+}
+
+spsc_t* spsc_create(size_t capacity) {
+  if(capacity < 2 || (capacity & (capacity - 1)) != 0) {
+    return NULL;
+  }
+
+  spsc_t* spsc = aligned_alloc(64, sizeof(spsc_t));
+  if(spsc == NULL) {
+    return NULL;
+  }
+  spsc->items = malloc(sizeof(void*) * capacity);
+  if(spsc->items == NULL) {
+    free(spsc);
+    return NULL;
+  }
+  spsc->mask = capacity - 1;
+  atomic_init(&spsc->head, 0);
+  atomic_init(&spsc->tail, 0);
+  spsc->cached_tail = 0;
+  spsc->cached_head = 0;
+  return spsc;
+}
+
+bool spsc_push(spsc_t* spsc, void* item) {
+  size_t head = atomic_load_explicit(&spsc->head, memory_order_relaxed);
+  if(head - spsc->cached_tail > spsc->mask) {
+    // Looks full; see how far the consumer has really got
+    spsc->cached_tail = atomic_load_explicit(&spsc->tail, memory_order_acquire);
+    if(head - spsc->cached_tail > spsc->mask) {
+      return false;
+    }
+  }
+  spsc->items[head & spsc->mask] = item;
+  atomic_store_explicit(&spsc->head, head + 1, memory_order_release);
+  return true;
+}
+
+void* spsc_pop(spsc_t* spsc) {
+  size_t tail = atomic_load_explicit(&spsc->tail, memory_order_relaxed);
+  if(tail == spsc->cached_head) {
+    // Looks empty; see whether the producer has published more
+    spsc->cached_head = atomic_load_explicit(&spsc->head, memory_order_acquire);
+    if(tail == spsc->cached_head) {
+      return NULL;
+    }
+  }
+  void* item = spsc->items[tail & spsc->mask];
+  atomic_store_explicit(&spsc->tail, tail + 1, memory_order_release);
+  return item;
+}
+
+void spsc_destroy(spsc_t* spsc) {
+  if(spsc == NULL) {
+    return;
+  }
+  free(spsc->items);
+  free(spsc);
+}
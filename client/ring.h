@@ -0,0 +1,98 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * A bounded, lock-free queue of pointers. Any number of threads may push and
+ * pop concurrently. Each slot carries a sequence number that tells producers
+ * and consumers whether it is free, so neither side ever takes a lock.
+ */
+typedef struct ring_slot {
+  atomic_size_t seq;
+  void* item;
+} ring_slot_t;
+
+typedef struct ring {
+  size_t mask;
+  ring_slot_t* slots;
+  // Keep the two ends on separate cache lines so producers and consumers
+  // don't bounce the same line between cores
+  _Alignas(64) atomic_size_t head;
+  _Alignas(64) atomic_size_t tail;
+} ring_t;
+
+/**
+ * Create a ring that can hold capacity items.
+ *
+ * \param capacity  The number of slots. Must be a power of two.
+ *
+ * \returns A new ring, or NULL if capacity is invalid or allocation fails.
+ */
+ring_t* ring_create(size_t capacity);
+
+/**
+ * Add an item to the ring without blocking.
+ *
+ * \returns true if the item was queued, false if the ring is full.
+ */
+bool ring_push(ring_t* ring, void* item);
+
+/**
+ * Remove the oldest item from the ring without blocking.
+ *
+ * \returns The item, or NULL if the ring is empty.
+ */
+void* ring_pop(ring_t* ring);
+
+/**
+ * Free the ring. Items still queued are not freed.
+ */
+void ring_destroy(ring_t* ring);
+
+/**
+ * A bounded, lock-free queue of pointers between exactly one producer and
+ * one consumer. With one thread at each end, neither needs a compare and
+ * swap: each end owns its index, and only reads the other's when its cached
+ * copy says the queue looks full or empty.
+ */
+typedef struct spsc {
+  size_t mask;
+  void** items;
+  _Alignas(64) atomic_size_t head;   // Written only by the producer
+  size_t cached_tail;                // The producer's last look at tail
+  _Alignas(64) atomic_size_t tail;   // Written only by the consumer
+  size_t cached_head;                // The consumer's last look at head
+} spsc_t;
+
+/**
+ * Create a single-producer, single-consumer queue.
+ *
+ * \param capacity  The number of slots. Must be a power of two.
+ *
+ * \returns A new queue, or NULL if capacity is invalid or allocation fails.
+ */
+spsc_t* spsc_create(size_t capacity);
+
+/**
+ * Add an item without blocking. Only the producer may call this.
+ *
+ * \returns true if the item was queued, false if the queue is full.
+ */
+bool spsc_push(spsc_t* spsc, void* item);
+
+/**
+ * Remove the oldest item without blocking. Only the consumer may call this.
+ *
+ * \returns The item, or NULL if the queue is empty.
+ */
+void* spsc_pop(spsc_t* spsc);
+
+/**
+ * Free the queue. Items still queued are not freed.
+ */
+void spsc_destroy(spsc_t* spsc);
+
+#endif
@@ -0,0 +1,282 @@
+#include "search.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Starting size of the term table. Must be a power of two.
+#define SEARCH_INITIAL_CAPACITY 1024
+// The most words a query can combine
+#define SEARCH_MAX_QUERY_TERMS 16
+
+// A decoded block of one posting list, reused while a query walks nearby postings
+typedef struct search_cursor {
+  posting_list_t* list;
+  size_t block;
+  size_t n;
+  uint64_t postings[SEARCH_SKIP_INTERVAL];
+} search_cursor_t;
+
+search_index_t* search_create() {
+  search_index_t* search = malloc(sizeof(search_index_t));
+  pthread_rwlock_init(&search->lock, NULL);
+  search->capacity = SEARCH_INITIAL_CAPACITY;
+  search->num_terms = 0;
+  search->table = calloc(search->capacity, sizeof(search_term_t));
+  return search;
+}
+
+// FNV-1a, which is quick and spreads short words well
+uint64_t search_hash(char* term) {
+  uint64_t hash = 14695981039346656037ULL;
+  for(unsigned char* c = (unsigned char*)term; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Read the next word from a string. Words are runs of letters, digits and
+ * non-ASCII bytes, folded to lower case and truncated to SEARCH_MAX_TERM.
+ *
+ * \param cursor  Where to start reading. Moved past the word.
+ * \param term    Receives the word.
+ *
+ * \returns The length of the word, or 0 when the string is used up.
+ */
+size_t search_next_term(char** cursor, char term[SEARCH_MAX_TERM + 1]) {
+  unsigned char* c = (unsigned char*)*cursor;
+  while(*c != '\0' && !isalnum(*c) && *c < 0x80) {
+    c++;
+  }
+  size_t len = 0;
+  while(*c != '\0' && (isalnum(*c) || *c >= 0x80)) {
+    if(len < SEARCH_MAX_TERM) {
+      term[len++] = tolower(*c);
+    }
+    c++;
+  }
+  term[len] = '\0';
+  *cursor = (char*)c;
+  return len;
+}
+
+// Find the slot for a term: either where it is, or the empty slot it would go in
+search_term_t* search_slot(search_term_t* table, size_t capacity, char* term) {
+  size_t i = search_hash(term) & (capacity - 1);
+  while(table[i].term != NULL && strcmp(table[i].term, term) != 0) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &table[i];
+}
+
+// Double the term table. Caller holds the write lock.
+void search_grow(search_index_t* search) {
+  size_t capacity = search->capacity * 2;
+  search_term_t* table = calloc(capacity, sizeof(search_term_t));
+  for(size_t i = 0; i < search->capacity; i++) {
+    if(search->table[i].term != NULL) {
+      *search_slot(table, capacity, search->table[i].term) = search->table[i];
+    }
+  }
+  free(search->table);
+  search->table = table;
+  search->capacity = capacity;
+}
+
+// Append a varint to a posting list's bytes
+void posting_put_varint(posting_list_t* list, uint64_t value) {
+  if(list->length + 10 > list->capacity) {
+    list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+    list->bytes = realloc(list->bytes, list->capacity);
+  }
+  while(value >= 0x80) {
+    list->bytes[list->length++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  list->bytes[list->length++] = value;
+}
+
+void posting_add(posting_list_t* list, uint64_t index) {
+  // A word used twice in one message is only indexed once
+  if(list->count > 0 && list->last == index) {
+    return;
+  }
+
+  // Start a new block
+  if(list->count % SEARCH_SKIP_INTERVAL == 0) {
+    if(list->num_skips == list->skips_capacity) {
+      list->skips_capacity = list->skips_capacity == 0 ? 4 : list->skips_capacity * 2;
+      list->skips = realloc(list->skips, sizeof(search_skip_t) * list->skips_capacity);
+    }
+    search_skip_t* skip = &list->skips[list->num_skips++];
+    skip->base = list->last;
+    skip->first = index;
+    skip->offset = list->length;
+  }
+
+  posting_put_varint(list, index - list->last);
+  list->last = index;
+  list->count++;
+}
+
+void search_add(search_index_t* search, uint64_t index, char* username, char* message) {
+  char term[SEARCH_MAX_TERM + 1];
+
+  pthread_rwlock_wrlock(&search->lock);
+  char* fields[2] = { username, message };
+  for(int f = 0; f < 2; f++) {
+    char* cursor = fields[f];
+    if(cursor == NULL) {
+      continue;
+    }
+    while(search_next_term(&cursor, term) > 0) {
+      search_term_t* slot = search_slot(search->table, search->capacity, term);
+      if(slot->term == NULL) {
+        slot->term = strdup(term);
+        memset(&slot->postings, 0, sizeof(posting_list_t));
+        search->num_terms++;
+      }
+      posting_add(&slot->postings, index);
+
+      // Keep the table under 70% full so probes stay short
+      if(search->num_terms * 10 >= search->capacity * 7) {
+        search_grow(search);
+      }
+    }
+  }
+  pthread_rwlock_unlock(&search->lock);
+}
+
+// Decode one block of a posting list into the cursor
+void search_decode_block(search_cursor_t* cursor, size_t block) {
+  posting_list_t* list = cursor->list;
+  search_skip_t* skip = &list->skips[block];
+  uint8_t* p = list->bytes + skip->offset;
+  uint64_t posting = skip->base;
+
+  size_t n = list->count - block * SEARCH_SKIP_INTERVAL;
+  if(n > SEARCH_SKIP_INTERVAL) {
+    n = SEARCH_SKIP_INTERVAL;
+  }
+  for(size_t i = 0; i < n; i++) {
+    uint64_t gap = 0;
+    int shift = 0;
+    while(*p & 0x80) {
+      gap |= (uint64_t)(*p++ & 0x7f) << shift;
+      shift += 7;
+    }
+    gap |= (uint64_t)*p++ << shift;
+    posting += gap;
+    cursor->postings[i] = posting;
+  }
+  cursor->block = block;
+  cursor->n = n;
+}
+
+// Check whether a posting list contains an index, decoding at most one block
+bool search_contains(search_cursor_t* cursor, uint64_t index) {
+  posting_list_t* list = cursor->list;
+  if(list->count == 0 || index < list->skips[0].first || index > list->last) {
+    return false;
+  }
+
+  // Find the last block starting at or before the index
+  size_t lo = 0;
+  size_t hi = list->num_skips;
+  while(hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if(list->skips[mid].first <= index) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  if(cursor->block != lo) {
+    search_decode_block(cursor, lo);
+  }
+
+  lo = 0;
+  hi = cursor->n;
+  while(lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if(cursor->postings[mid] < index) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < cursor->n && cursor->postings[lo] == index;
+}
+
+size_t search_query(search_index_t* search, char* query, uint64_t* results, size_t max_results) {
+  char term[SEARCH_MAX_TERM + 1];
+  search_cursor_t* cursors[SEARCH_MAX_QUERY_TERMS];
+  size_t num_cursors = 0;
+  size_t found = 0;
+
+  pthread_rwlock_rdlock(&search->lock);
+
+  // Look up every word; a word that was never seen means nothing can match
+  char* p = query;
+  bool missing = false;
+  while(num_cursors < SEARCH_MAX_QUERY_TERMS && search_next_term(&p, term) > 0) {
+    search_term_t* slot = search_slot(search->table, search->capacity, term);
+    if(slot->term == NULL) {
+      missing = true;
+      break;
+    }
+    search_cursor_t* cursor = malloc(sizeof(search_cursor_t));
+    cursor->list = &slot->postings;
+    cursor->block = SIZE_MAX;
+    cursors[num_cursors++] = cursor;
+  }
+
+  if(!missing && num_cursors > 0) {
+    // Walk the shortest list from its newest block back, probing the others
+    size_t shortest = 0;
+    for(size_t i = 1; i < num_cursors; i++) {
+      if(cursors[i]->list->count < cursors[shortest]->list->count) {
+        shortest = i;
+      }
+    }
+    search_cursor_t* driver = cursors[shortest];
+
+    for(size_t block = driver->list->num_skips; block > 0 && found < max_results; block--) {
+      search_decode_block(driver, block - 1);
+      for(size_t i = driver->n; i > 0 && found < max_results; i--) {
+        uint64_t index = driver->postings[i - 1];
+        bool match = true;
+        for(size_t c = 0; c < num_cursors && match; c++) {
+          if(c != shortest) {
+            match = search_contains(cursors[c], index);
+          }
+        }
+        if(match) {
+          results[found++] = index;
+        }
+      }
+    }
+  }
+  pthread_rwlock_unlock(&search->lock);
+
+  for(size_t i = 0; i < num_cursors; i++) {
+    free(cursors[i]);
+  }
+  return found;
+}
+
+void search_destroy(search_index_t* search) {
+  for(size_t i = 0; i < search->capacity; i++) {
+    if(search->table[i].term != NULL) {
+      free(search->table[i].term);
+      free(search->table[i].postings.bytes);
+      free(search->table[i].postings.skips);
+    }
+  }
+  free(search->table);
+  pthread_rwlock_destroy(&search->lock);
+  free(search);
+}
@@ -0,0 +1,84 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * An inverted index from words to the history indexes of the messages that
+ * contain them. Messages are added as they arrive, and each word's posting
+ * list is stored as varint-encoded gaps between indexes, so a list costs
+ * about a byte per posting. Every SEARCH_SKIP_INTERVAL postings a skip entry
+ * records where a block starts, which lets a query decode only the blocks
+ * it needs instead of the whole list.
+ */
+#define SEARCH_SKIP_INTERVAL 128
+
+// Longer words are indexed by their first SEARCH_MAX_TERM characters
+#define SEARCH_MAX_TERM 32
+
+typedef struct search_skip {
+  uint64_t base;    // The posting before this block, which its first gap is relative to
+  uint64_t first;   // The first posting in this block
+  size_t offset;    // Where this block's bytes start
+} search_skip_t;
+
+typedef struct posting_list {
+  uint8_t* bytes;
+  size_t length;
+  size_t capacity;
+  uint64_t count;
+  uint64_t last;
+  search_skip_t* skips;
+  size_t num_skips;
+  size_t skips_capacity;
+} posting_list_t;
+
+typedef struct search_term {
+  char* term;
+  posting_list_t postings;
+} search_term_t;
+
+typedef struct search_index {
+  pthread_rwlock_t lock;
+  search_term_t* table;   // Open-addressed hash table of terms
+  size_t capacity;
+  size_t num_terms;
+} search_index_t;
+
+/**
+ * Create an empty index.
+ */
+search_index_t* search_create();
+
+/**
+ * Index the words of a message. Messages must be added in increasing index
+ * order; the caller is responsible for serializing calls that race.
+ *
+ * \param index     The message's index in the history.
+ * \param username  The sender, or NULL. Its name is indexed as a word too.
+ *                  This function does *not* take ownership of this memory.
+ * \param message   The message text. This function does *not* take
+ *                  ownership of this memory.
+ */
+void search_add(search_index_t* search, uint64_t index, char* username, char* message);
+
+/**
+ * Find messages containing every word in a query. Safe to call while other
+ * threads add messages.
+ *
+ * \param query        Words separated by spaces or punctuation. Case is ignored.
+ * \param results      Filled with matching message indexes, newest first.
+ * \param max_results  The most results to return.
+ *
+ * \returns The number of results written.
+ */
+size_t search_query(search_index_t* search, char* query, uint64_t* results, size_t max_results);
+
+/**
+ * Free the index.
+ */
+void search_destroy(search_index_t* search);
+
+#endif
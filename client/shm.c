@@ -0,0 +1,378 @@
+// memfd_create and POLLRDHUP are GNU extensions
+#define _GNU_SOURCE
+#include "shm.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Channels offered to us that haven't been claimed yet
+typedef struct shm_pending {
+  uint64_t token;
+  int fds[SHM_FDS];
+  time_t offered;
+  struct shm_pending* next;
+} shm_pending_t;
+
+shm_pending_t* shm_pending = NULL;
+int shm_pending_count = 0;
+pthread_mutex_t shm_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+int shm_listen_fd = -1;
+
+// Map a channel's memfd and point each side at its own rings
+shm_channel_t* shm_map(int* fds, bool creator, int watch_fd) {
+  shm_ring_t* rings = mmap(NULL, 2 * sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if(rings == MAP_FAILED) {
+    return NULL;
+  }
+  shm_channel_t* shm = malloc(sizeof(shm_channel_t));
+  memcpy(shm->fds, fds, sizeof(shm->fds));
+  shm->rings = rings;
+  shm->watch_fd = watch_fd;
+  // The creator writes ring 0 and reads ring 1; the other end does the opposite
+  int out = creator ? 0 : 1;
+  shm->out = &rings[out];
+  shm->in = &rings[1 - out];
+  shm->out_data = fds[1 + 2 * out];
+  shm->out_space = fds[2 + 2 * out];
+  shm->in_data = fds[1 + 2 * (1 - out)];
+  shm->in_space = fds[2 + 2 * (1 - out)];
+  return shm;
+}
+
+shm_channel_t* shm_create(int watch_fd) {
+  int fds[SHM_FDS];
+  fds[0] = memfd_create("chat-link", MFD_CLOEXEC);
+  if(fds[0] == -1) {
+    return NULL;
+  }
+  // A new memfd reads as zeros, which is two empty rings
+  if(ftruncate(fds[0], 2 * sizeof(shm_ring_t)) == -1) {
+    close(fds[0]);
+    return NULL;
+  }
+  for(int i = 1; i < SHM_FDS; i++) {
+    fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fds[i] == -1) {
+      for(int j = 0; j < i; j++) {
+        close(fds[j]);
+      }
+      return NULL;
+    }
+  }
+  shm_channel_t* shm = shm_map(fds, true, watch_fd);
+  if(shm == NULL) {
+    for(int i = 0; i < SHM_FDS; i++) {
+      close(fds[i]);
+    }
+  }
+  return shm;
+}
+
+// Fill in the address of a socket in the abstract namespace
+socklen_t shm_address(char* name, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path + 1, name, sizeof(addr->sun_path) - 2);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1);
+}
+
+int shm_offer(shm_channel_t* shm, char* name, uint64_t token) {
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(sock == -1) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t addr_len = shm_address(name, &addr);
+  if(connect(sock, (struct sockaddr*)&addr, addr_len) == -1) {
+    close(sock);
+    return -1;
+  }
+
+  // The token rides along with the descriptors
+  struct iovec iov = { .iov_base = &token, .iov_len = sizeof(token) };
+  char control[CMSG_SPACE(sizeof(int) * SHM_FDS)];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control)
+  };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SHM_FDS);
+  memcpy(CMSG_DATA(cmsg), shm->fds, sizeof(int) * SHM_FDS);
+
+  // Wait for the ack, so the channel is ready to claim before we say so over the link
+  char ack;
+  int result = sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(token) && read(sock, &ack, 1) == 1 ? 0 : -1;
+  close(sock);
+  return result;
+}
+
+// Close the descriptors of offers nobody claimed in time. Caller holds shm_pending_lock.
+void shm_pending_expire() {
+  time_t now = time(NULL);
+  shm_pending_t** p = &shm_pending;
+  while(*p != NULL) {
+    shm_pending_t* offer = *p;
+    if(now - offer->offered < SHM_PENDING_TIMEOUT) {
+      p = &offer->next;
+      continue;
+    }
+    *p = offer->next;
+    for(int i = 0; i < SHM_FDS; i++) {
+      close(offer->fds[i]);
+    }
+    free(offer);
+    shm_pending_count--;
+  }
+}
+
+// Whether the process on the other end of a unix socket runs as our user
+bool shm_peer_trusted(int sock) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+void* shm_listen_thread_fn(void* p) {
+  while(true) {
+    int sock = accept(shm_listen_fd, NULL, NULL);
+    if(sock == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if(!shm_peer_trusted(sock)) {
+      close(sock);
+      continue;
+    }
+    // A peer that connects and says nothing mustn't hold up everyone else
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint64_t token;
+    struct iovec iov = { .iov_base = &token, .iov_len = sizeof(token) };
+    char control[CMSG_SPACE(sizeof(int) * SHM_FDS)];
+    struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control)
+    };
+    ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr* cmsg = received == -1 ? NULL : CMSG_FIRSTHDR(&msg);
+    bool rights = cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS;
+    if(received == sizeof(token) && rights && cmsg->cmsg_len == CMSG_LEN(sizeof(int) * SHM_FDS)) {
+      pthread_mutex_lock(&shm_pending_lock);
+      shm_pending_expire();
+      bool room = shm_pending_count < SHM_MAX_PENDING;
+      if(room) {
+        shm_pending_t* offer = malloc(sizeof(shm_pending_t));
+        offer->token = token;
+        memcpy(offer->fds, CMSG_DATA(cmsg), sizeof(offer->fds));
+        offer->offered = time(NULL);
+        offer->next = shm_pending;
+        shm_pending = offer;
+        shm_pending_count++;
+      }
+      pthread_mutex_unlock(&shm_pending_lock);
+      if(room) {
+        char ack = 1;
+        write(sock, &ack, 1);
+        rights = false;
+      }
+    }
+    // Close whatever descriptors came with a message we didn't take; the
+    // kernel already dropped any past the SHM_FDS the buffer has room for
+    if(rights) {
+      int fds[SHM_FDS];
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+      for(int i = 0; i < count; i++) {
+        close(fds[i]);
+      }
+    }
+    close(sock);
+  }
+  return NULL;
+}
+
+int shm_listen(char* name) {
+  shm_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(shm_listen_fd == -1) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t addr_len = shm_address(name, &addr);
+  if(bind(shm_listen_fd, (struct sockaddr*)&addr, addr_len) == -1 || listen(shm_listen_fd, 16) == -1) {
+    close(shm_listen_fd);
+    shm_listen_fd = -1;
+    return -1;
+  }
+  pthread_t listen_thread;
+  if(pthread_create(&listen_thread, NULL, shm_listen_thread_fn, NULL)) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(listen_thread);
+  return 0;
+}
+
+shm_channel_t* shm_claim(uint64_t token, int watch_fd) {
+  pthread_mutex_lock(&shm_pending_lock);
+  shm_pending_expire();
+  shm_pending_t* offer = NULL;
+  for(shm_pending_t** p = &shm_pending; *p != NULL; p = &(*p)->next) {
+    if((*p)->token == token) {
+      offer = *p;
+      *p = offer->next;
+      shm_pending_count--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&shm_pending_lock);
+  if(offer == NULL) {
+    return NULL;
+  }
+  shm_channel_t* shm = shm_map(offer->fds, false, watch_fd);
+  if(shm == NULL) {
+    for(int i = 0; i < SHM_FDS; i++) {
+      close(offer->fds[i]);
+    }
+  }
+  free(offer);
+  return shm;
+}
+
+// Sleep until the other side signals an eventfd. Returns -1 if it hung up instead.
+int shm_sleep(shm_channel_t* shm, shm_ring_t* ring, _Atomic uint32_t* waiting, int efd, bool for_space) {
+  atomic_store(waiting, 1);
+  // Look again with the flag up, or a wakeup sent just before it went up would be missed
+  uint64_t used = atomic_load(&ring->tail) - atomic_load(&ring->head);
+  bool ready = for_space ? used < SHM_RING_SIZE : used > 0;
+  int result = 0;
+  if(!ready) {
+    // The socket may still carry frames while the other direction moves over, so only a hangup
+    // on it counts, not data
+    struct pollfd fds[2] = {
+      { .fd = efd, .events = POLLIN },
+      { .fd = shm->watch_fd, .events = POLLRDHUP }
+    };
+    while(poll(fds, 2, -1) == -1 && errno == EINTR) {
+    }
+    if(fds[0].revents & POLLIN) {
+      uint64_t count;
+      read(efd, &count, sizeof(count));
+    } else {
+      result = -1;
+    }
+  }
+  atomic_store(waiting, 0);
+  return result;
+}
+
+// Copy bytes into the outgoing ring, waiting for space as needed
+int shm_put(shm_channel_t* shm, char* src, size_t length) {
+  shm_ring_t* ring = shm->out;
+  while(length > 0) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t space = SHM_RING_SIZE - (tail - atomic_load_explicit(&ring->head, memory_order_acquire));
+    if(space == 0) {
+      if(shm_sleep(shm, ring, &ring->writer_waiting, shm->out_space, true) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    size_t n = length < space ? length : space;
+    size_t offset = tail % SHM_RING_SIZE;
+    size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, src + first, n - first);
+    atomic_store(&ring->tail, tail + n);
+    src += n;
+    length -= n;
+
+    if(atomic_load(&ring->reader_waiting)) {
+      uint64_t one = 1;
+      write(shm->out_data, &one, sizeof(one));
+    }
+  }
+  return 0;
+}
+
+// Copy bytes out of the incoming ring, waiting for them as needed
+int shm_get(shm_channel_t* shm, char* dst, size_t length) {
+  shm_ring_t* ring = shm->in;
+  while(length > 0) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t used = atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+    if(used == 0) {
+      if(shm_sleep(shm, ring, &ring->reader_waiting, shm->in_data, false) == -1) {
+        return -1;
+      }
+      continue;
+    }
+    size_t n = length < used ? length : used;
+    size_t offset = head % SHM_RING_SIZE;
+    size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+    memcpy(dst, ring->data + offset, first);
+    memcpy(dst + first, ring->data, n - first);
+    atomic_store(&ring->head, head + n);
+    dst += n;
+    length -= n;
+
+    if(atomic_load(&ring->writer_waiting)) {
+      uint64_t one = 1;
+      write(shm->in_space, &one, sizeof(one));
+    }
+  }
+  return 0;
+}
+
+int shm_write_frame(shm_channel_t* shm, frame_t* frame) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  frame_encode_header(frame, header);
+  if(shm_put(shm, (char*)header, FRAME_HEADER_SIZE) == -1) {
+    return -1;
+  }
+  return shm_put(shm, frame->payload, frame->length);
+}
+
+frame_t* shm_read_frame(shm_channel_t* shm) {
+  unsigned char header[FRAME_HEADER_SIZE];
+  if(shm_get(shm, (char*)header, FRAME_HEADER_SIZE) == -1) {
+    return NULL;
+  }
+  frame_t* frame = frame_decode_header(header);
+  if(frame == NULL) {
+    return NULL;
+  }
+  if(shm_get(shm, frame->payload, frame->length) == -1) {
+    frame_free(frame);
+    return NULL;
+  }
+  return frame;
+}
+
+void shm_destroy(shm_channel_t* shm) {
+  munmap(shm->rings, 2 * sizeof(shm_ring_t));
+  for(int i = 0; i < SHM_FDS; i++) {
+    close(shm->fds[i]);
+  }
+  free(shm);
+}
@@ -0,0 +1,116 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+/**
+ * A shared-memory transport for a link between two peers on the same host.
+ * A memfd holds two single-producer, single-consumer byte rings, one for
+ * each direction. Frames are copied in and out of a ring with no system
+ * calls at all while both sides keep up. A side that finds its ring empty
+ * (or full) sets a flag and sleeps on an eventfd, which the other side only
+ * writes if it sees the flag.
+ *
+ * The peer that connects creates the channel and hands its descriptors to
+ * the other over the unix socket that peer listens on (see shm_listen), in
+ * the abstract namespace so nothing is left behind in the filesystem. The
+ * TCP connection the link started on stays open: nothing more is sent on
+ * it, but its hangup is how each side learns the other has gone.
+ */
+#define SHM_RING_SIZE (256 * 1024)
+
+typedef struct shm_ring {
+  _Atomic uint64_t head;             // Bytes consumed; written by the consumer
+  char pad1[56];
+  _Atomic uint64_t tail;             // Bytes produced; written by the producer
+  char pad2[56];
+  _Atomic uint32_t reader_waiting;   // The consumer is asleep on the data eventfd
+  _Atomic uint32_t writer_waiting;   // The producer is asleep on the space eventfd
+  char pad3[56];
+  char data[SHM_RING_SIZE];
+} shm_ring_t;
+
+// The descriptors a channel is passed as: the memfd, then for each ring its data and space eventfds
+#define SHM_FDS 5
+
+// At most this many offered channels wait to be claimed, each for at most this long
+#define SHM_MAX_PENDING 16
+#define SHM_PENDING_TIMEOUT 10
+
+typedef struct shm_channel {
+  int fds[SHM_FDS];
+  shm_ring_t* rings;     // The mapping of both rings
+  shm_ring_t* out;
+  shm_ring_t* in;
+  int out_data;          // Written to wake the peer reading out
+  int out_space;         // Waited on when out is full
+  int in_data;           // Waited on when in is empty
+  int in_space;          // Written to wake the peer writing in
+  int watch_fd;          // Signals POLLRDHUP or POLLHUP once the peer has hung up
+} shm_channel_t;
+
+/**
+ * Create a channel to hand to a peer.
+ *
+ * \param watch_fd  A socket to the peer, watched for it hanging up.
+ *
+ * \returns The channel, or NULL if it couldn't be created.
+ */
+shm_channel_t* shm_create(int watch_fd);
+
+/**
+ * Hand a channel to the peer listening on a unix socket, and wait for it to
+ * take the descriptors.
+ *
+ * \param name   The peer's socket name, without the leading NUL.
+ * \param token  Names the channel when the peer claims it.
+ *
+ * \returns 0 on success, -1 if the peer couldn't be reached.
+ */
+int shm_offer(shm_channel_t* shm, char* name, uint64_t token);
+
+/**
+ * Start a thread that takes channels offered to us on a unix socket. Only
+ * processes of our own user may offer, and offers nobody claims within
+ * SHM_PENDING_TIMEOUT seconds are dropped. Past SHM_MAX_PENDING unclaimed
+ * offers, new ones are refused.
+ *
+ * \param name  The socket name, without the leading NUL. Not owned by this function.
+ *
+ * \returns 0 on success, -1 if the socket couldn't be set up.
+ */
+int shm_listen(char* name);
+
+/**
+ * Claim a channel that was offered to us, from the other end.
+ *
+ * \param token     The token it was offered with.
+ * \param watch_fd  A socket to the peer, watched for it hanging up.
+ *
+ * \returns The channel, or NULL if no channel was offered with that token.
+ */
+shm_channel_t* shm_claim(uint64_t token, int watch_fd);
+
+/**
+ * Copy a frame into the outgoing ring, waiting for space as needed.
+ *
+ * \returns 0 on success, -1 if the peer hung up.
+ */
+int shm_write_frame(shm_channel_t* shm, frame_t* frame);
+
+/**
+ * Read the next frame from the incoming ring, waiting for it as needed.
+ *
+ * \returns The frame, or NULL if the peer hung up or sent garbage.
+ */
+frame_t* shm_read_frame(shm_channel_t* shm);
+
+/**
+ * Unmap the channel and close its descriptors.
+ */
+void shm_destroy(shm_channel_t* shm);
+
+#endif
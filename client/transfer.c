@@ -0,0 +1,267 @@
+#include "transfer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Bytes before the username in a FRAME_XFER payload, and before the data in a FRAME_CHUNK
+#define START_HEADER_SIZE 17
+#define CHUNK_HEADER_SIZE 8
+// Names tried for a file before giving up, when earlier ones are taken
+#define TRANSFER_PATH_ATTEMPTS 100
+
+transfer_table_t* transfer_table_create(char* download_dir) {
+  transfer_table_t* table = malloc(sizeof(transfer_table_t));
+  pthread_mutex_init(&table->m, NULL);
+  table->transfers = NULL;
+  table->memory_used = 0;
+  table->download_dir = download_dir;
+  table->expired_at = 0;
+  return table;
+}
+
+void put32(char* p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, 4);
+}
+
+uint32_t get32(char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+frame_t* transfer_start_frame(uint32_t origin, uint32_t seq, uint32_t id, uint8_t kind,
+                              uint64_t total, char* username, char* name) {
+  uint32_t chunks = (total + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+  size_t length = START_HEADER_SIZE + strlen(username) + 2 + strlen(name);
+  char* payload = malloc(length + 1);
+  put32(payload, id);
+  payload[4] = kind;
+  put32(payload + 5, total >> 32);
+  put32(payload + 9, total & 0xffffffff);
+  put32(payload + 13, chunks);
+  sprintf(payload + START_HEADER_SIZE, "%s#!%s", username, name);
+
+  frame_t* frame = frame_create(FRAME_XFER, origin, seq, payload, length);
+  free(payload);
+  return frame;
+}
+
+frame_t* transfer_chunk_frame(uint32_t origin, uint32_t seq, uint32_t id, uint32_t index,
+                              char* data, uint32_t length, bool compress) {
+  char* payload = malloc(CHUNK_HEADER_SIZE + length);
+  put32(payload, id);
+  put32(payload + 4, index);
+  memcpy(payload + CHUNK_HEADER_SIZE, data, length);
+
+  frame_t* frame = frame_build(FRAME_CHUNK, origin, seq, payload, CHUNK_HEADER_SIZE + length, compress);
+  free(payload);
+  return frame;
+}
+
+void transfer_free(transfer_t* transfer) {
+  if(transfer->fd != -1) {
+    close(transfer->fd);
+  }
+  free(transfer->username);
+  free(transfer->name);
+  free(transfer->data);
+  free(transfer->path);
+  free(transfer->have);
+  free(transfer);
+}
+
+// What a transfer holds in memory: its chunk bitmap, and text as it's gathered
+uint64_t transfer_memory(uint8_t kind, uint64_t total, uint32_t chunks) {
+  return chunks / 8 + 1 + (kind == TRANSFER_TEXT ? total : 0);
+}
+
+// Take a transfer out of the table, giving back its memory. Caller holds the lock.
+void transfer_unlink(transfer_table_t* table, transfer_t* transfer) {
+  transfer_t** p = &table->transfers;
+  while(*p != transfer) {
+    p = &(*p)->next;
+  }
+  *p = transfer->next;
+  table->memory_used -= transfer_memory(transfer->kind, transfer->total, transfer->chunks);
+}
+
+// Drop transfers whose sender went quiet, e.g. because a link broke mid-way
+void transfer_expire(transfer_table_t* table, time_t now) {
+  transfer_t* transfer = table->transfers;
+  while(transfer != NULL) {
+    transfer_t* next = transfer->next;
+    if(now - transfer->last_active > TRANSFER_TIMEOUT) {
+      transfer_unlink(table, transfer);
+      if(transfer->path != NULL) {
+        unlink(transfer->path);
+      }
+      transfer_free(transfer);
+    }
+    transfer = next;
+  }
+}
+
+transfer_t* transfer_find(transfer_table_t* table, uint32_t origin, uint32_t id) {
+  for(transfer_t* t = table->transfers; t != NULL; t = t->next) {
+    if(t->origin == origin && t->id == id) {
+      return t;
+    }
+  }
+  return NULL;
+}
+
+// Start tracking a transfer from its FRAME_XFER payload. Caller holds the lock.
+void transfer_start(transfer_table_t* table, uint32_t origin, char* payload, uint32_t length) {
+  if(length < START_HEADER_SIZE) {
+    return;
+  }
+  uint32_t id = get32(payload);
+  uint8_t kind = payload[4];
+  uint64_t total = ((uint64_t)get32(payload + 5) << 32) | get32(payload + 9);
+  uint32_t chunks = get32(payload + 13);
+  uint64_t max_total = kind == TRANSFER_TEXT ? TRANSFER_MEMORY_BUDGET : TRANSFER_MAX_FILE_SIZE;
+  if((kind != TRANSFER_TEXT && kind != TRANSFER_FILE) || total == 0 || total > max_total ||
+     chunks != (total + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE || transfer_find(table, origin, id) != NULL) {
+    return;
+  }
+  // The sender picks the size, so what it costs us has to fit in what's left of the budget
+  uint64_t memory = transfer_memory(kind, total, chunks);
+  if(table->memory_used + memory > TRANSFER_MEMORY_BUDGET) {
+    return;
+  }
+
+  char* names = strndup(payload + START_HEADER_SIZE, length - START_HEADER_SIZE);
+  char* separator = strstr(names, "#!");
+  if(separator == NULL) {
+    free(names);
+    return;
+  }
+  *separator = '\0';
+
+  transfer_t* transfer = calloc(1, sizeof(transfer_t));
+  transfer->origin = origin;
+  transfer->id = id;
+  transfer->kind = kind;
+  transfer->total = total;
+  transfer->chunks = chunks;
+  transfer->username = strdup(names);
+  transfer->name = strdup(separator + 2);
+  transfer->fd = -1;
+  transfer->last_active = time(NULL);
+  transfer->have = calloc(chunks / 8 + 1, 1);
+  free(names);
+
+  if(kind == TRANSFER_TEXT) {
+    transfer->data = malloc(total + 1);
+  } else {
+    // Only keep the last path component, so a sender can't pick where we write
+    char* base = strrchr(transfer->name, '/');
+    base = base == NULL ? transfer->name : base + 1;
+    if(*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+      base = "file";
+    }
+    // Never write through a link, or over a file that's already there, e.g. from an earlier session
+    char path[PATH_MAX];
+    for(int attempt = 0; attempt < TRANSFER_PATH_ATTEMPTS && transfer->fd == -1; attempt++) {
+      if(attempt == 0) {
+        snprintf(path, sizeof(path), "%s/%u-%u-%s", table->download_dir, origin, id, base);
+      } else {
+        snprintf(path, sizeof(path), "%s/%u-%u-%s.%d", table->download_dir, origin, id, base, attempt);
+      }
+      transfer->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+      if(transfer->fd == -1 && errno != EEXIST) {
+        break;
+      }
+    }
+    if(transfer->fd == -1) {
+      perror("transfer open failed");
+      transfer_free(transfer);
+      return;
+    }
+    transfer->path = strdup(path);
+  }
+
+  table->memory_used += memory;
+  transfer->next = table->transfers;
+  table->transfers = transfer;
+}
+
+// Store one chunk. Returns the transfer if it is now complete. Caller holds the lock.
+transfer_t* transfer_chunk(transfer_table_t* table, uint32_t origin, char* payload, uint32_t length) {
+  if(length < CHUNK_HEADER_SIZE) {
+    return NULL;
+  }
+  transfer_t* transfer = transfer_find(table, origin, get32(payload));
+  uint32_t index = get32(payload + 4);
+  if(transfer == NULL || index >= transfer->chunks || transfer->have[index / 8] & (1 << index % 8)) {
+    return NULL;
+  }
+
+  // Every chunk but the last is full size
+  uint64_t offset = (uint64_t)index * TRANSFER_CHUNK_SIZE;
+  uint64_t expected = transfer->total - offset;
+  if(expected > TRANSFER_CHUNK_SIZE) {
+    expected = TRANSFER_CHUNK_SIZE;
+  }
+  if(length - CHUNK_HEADER_SIZE != expected) {
+    return NULL;
+  }
+
+  char* data = payload + CHUNK_HEADER_SIZE;
+  if(transfer->kind == TRANSFER_TEXT) {
+    memcpy(transfer->data + offset, data, expected);
+  } else if(pwrite(transfer->fd, data, expected, offset) != (ssize_t)expected) {
+    perror("transfer write failed");
+    return NULL;
+  }
+  transfer->have[index / 8] |= 1 << index % 8;
+  transfer->received++;
+  transfer->last_active = time(NULL);
+
+  if(transfer->received < transfer->chunks) {
+    return NULL;
+  }
+  transfer_unlink(table, transfer);
+  if(transfer->kind == TRANSFER_TEXT) {
+    transfer->data[transfer->total] = '\0';
+  } else {
+    close(transfer->fd);
+    transfer->fd = -1;
+  }
+  return transfer;
+}
+
+transfer_t* transfer_receive(transfer_table_t* table, frame_t* frame) {
+  char* plain;
+  uint32_t length;
+  if(frame_payload(frame, &plain, &length) == -1) {
+    return NULL;
+  }
+
+  transfer_t* done = NULL;
+  pthread_mutex_lock(&table->m);
+  // Look for stale transfers as chunks arrive too, not only when a new one starts; once a second will do
+  time_t now = time(NULL);
+  if(now != table->expired_at) {
+    table->expired_at = now;
+    transfer_expire(table, now);
+  }
+  if(frame->type == FRAME_XFER) {
+    transfer_start(table, frame->origin, plain, length);
+  } else if(frame->type == FRAME_CHUNK) {
+    done = transfer_chunk(table, frame->origin, plain, length);
+  }
+  pthread_mutex_unlock(&table->m);
+
+  if(plain != frame->payload) {
+    free(plain);
+  }
+  return done;
+}
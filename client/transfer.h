@@ -0,0 +1,103 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "frame.h"
+
+/**
+ * Payloads too big for one message travel as a transfer: a FRAME_XFER frame
+ * describing it, then FRAME_CHUNK frames of at most TRANSFER_CHUNK_SIZE
+ * bytes each. Chunks are ordinary frames, so every relay forwards chunk i as
+ * soon as it arrives while i+1 is still on the wire, and a payload crosses
+ * the tree in about one chunk's time per hop rather than its whole size.
+ *
+ * FRAME_XFER payload:  id (4) | kind (1) | total size (8) | chunks (4) | "username#!name"
+ * FRAME_CHUNK payload: id (4) | index (4) | data
+ *
+ * Receivers write file chunks straight to disk. Text is gathered in memory.
+ * Both keep a bit per chunk to track which have arrived, and all of it must
+ * fit within TRANSFER_MEMORY_BUDGET across all transfers; a transfer that
+ * would not fit, or a file over TRANSFER_MAX_FILE_SIZE, is still relayed but
+ * not saved or shown.
+ */
+#define TRANSFER_CHUNK_SIZE (16 * 1024)
+#define TRANSFER_MEMORY_BUDGET (8 * 1024 * 1024)
+#define TRANSFER_MAX_FILE_SIZE (16ULL * 1024 * 1024 * 1024)
+// Unfinished transfers are abandoned after this many seconds of silence
+#define TRANSFER_TIMEOUT 60
+
+// Kinds of transfer
+#define TRANSFER_TEXT 1
+#define TRANSFER_FILE 2
+
+typedef struct transfer {
+  uint32_t origin;
+  uint32_t id;
+  uint8_t kind;
+  uint64_t total;
+  uint32_t chunks;
+  uint32_t received;
+  uint8_t* have;  // A bit per chunk, set once it's stored
+  char* username;
+  char* name;
+  char* data;     // Text being gathered in memory
+  int fd;         // File being written to disk
+  char* path;
+  time_t last_active;
+  struct transfer* next;
+} transfer_t;
+
+typedef struct transfer_table {
+  pthread_mutex_t m;
+  transfer_t* transfers;
+  uint64_t memory_used;
+  char* download_dir;
+  time_t expired_at;  // When stale transfers were last looked for
+} transfer_table_t;
+
+/**
+ * Create a table of incoming transfers.
+ *
+ * \param download_dir  Where received files are saved. Not owned by the table.
+ */
+transfer_table_t* transfer_table_create(char* download_dir);
+
+/**
+ * Build the frame that announces a transfer.
+ *
+ * \param username  The sender's name. Not owned by this function.
+ * \param name      The file name, or a label for text. Not owned by this function.
+ */
+frame_t* transfer_start_frame(uint32_t origin, uint32_t seq, uint32_t id, uint8_t kind,
+                              uint64_t total, char* username, char* name);
+
+/**
+ * Build the frame for one chunk of a transfer, compressing it if that helps.
+ *
+ * \param data  The chunk's bytes. Not owned by this function.
+ */
+frame_t* transfer_chunk_frame(uint32_t origin, uint32_t seq, uint32_t id, uint32_t index,
+                              char* data, uint32_t length, bool compress);
+
+/**
+ * Feed a FRAME_XFER or FRAME_CHUNK frame to the table. Safe to call from
+ * any thread. Chunks may arrive out of order while a peer moves in the
+ * tree and hears the sender two ways, so each is stored at its own offset.
+ * A transfer that misses one is dropped once TRANSFER_TIMEOUT passes
+ * without any of its chunks, which is checked as frames arrive.
+ *
+ * \returns The transfer if this frame completed it, or NULL. The caller
+ *          owns a completed transfer and frees it with transfer_free.
+ */
+transfer_t* transfer_receive(transfer_table_t* table, frame_t* frame);
+
+/**
+ * Free a transfer returned by transfer_receive.
+ */
+void transfer_free(transfer_t* transfer);
+
+#endif
@@ -0,0 +1,99 @@
+#include "tree.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+frame_t* tree_place_frame(uint32_t origin, tree_place_t* place) {
+  char payload[TREE_PLACE_SIZE];
+  uint16_t depth = htons(place->depth);
+  uint16_t spare = htons(place->spare);
+  uint16_t grandparent_spare = htons(place->grandparent_spare);
+  uint32_t promote = htonl(place->promote);
+  // The address and port are already in network order
+  memcpy(payload, &depth, 2);
+  memcpy(payload + 2, &spare, 2);
+  memcpy(payload + 4, &place->grandparent.sin_addr.s_addr, 4);
+  memcpy(payload + 8, &place->grandparent.sin_port, 2);
+  memcpy(payload + 10, &grandparent_spare, 2);
+  memcpy(payload + 12, &promote, 4);
+  return frame_create(FRAME_PLACE, origin, 0, payload, TREE_PLACE_SIZE);
+}
+
+int tree_read_place(frame_t* frame, tree_place_t* place) {
+  if(frame->type != FRAME_PLACE || frame->length != TREE_PLACE_SIZE) {
+    return -1;
+  }
+  uint16_t depth, spare, grandparent_spare;
+  uint32_t promote;
+  memset(place, 0, sizeof(tree_place_t));
+  memcpy(&depth, frame->payload, 2);
+  memcpy(&spare, frame->payload + 2, 2);
+  place->grandparent.sin_family = AF_INET;
+  memcpy(&place->grandparent.sin_addr.s_addr, frame->payload + 4, 4);
+  memcpy(&place->grandparent.sin_port, frame->payload + 8, 2);
+  memcpy(&grandparent_spare, frame->payload + 10, 2);
+  memcpy(&promote, frame->payload + 12, 4);
+  place->depth = ntohs(depth);
+  place->spare = ntohs(spare);
+  place->grandparent_spare = ntohs(grandparent_spare);
+  place->promote = ntohl(promote);
+  return 0;
+}
+
+frame_t* tree_summary_frame(uint32_t origin, tree_summary_t* summary) {
+  char payload[TREE_SUMMARY_SIZE];
+  uint32_t size = htonl(summary->size);
+  uint16_t height = htons(summary->height);
+  uint16_t spare = htons(summary->spare);
+  uint16_t port = htons(summary->port);
+  memcpy(payload, &size, 4);
+  memcpy(payload + 4, &height, 2);
+  memcpy(payload + 6, &spare, 2);
+  memcpy(payload + 8, &port, 2);
+  return frame_create(FRAME_SUMMARY, origin, 0, payload, TREE_SUMMARY_SIZE);
+}
+
+int tree_read_summary(frame_t* frame, tree_summary_t* summary) {
+  if(frame->type != FRAME_SUMMARY || frame->length != TREE_SUMMARY_SIZE) {
+    return -1;
+  }
+  uint32_t size;
+  uint16_t height;
+  uint16_t spare;
+  uint16_t port;
+  memcpy(&size, frame->payload, 4);
+  memcpy(&height, frame->payload + 4, 2);
+  memcpy(&spare, frame->payload + 6, 2);
+  memcpy(&port, frame->payload + 8, 2);
+  summary->size = ntohl(size);
+  summary->height = ntohs(height);
+  summary->spare = ntohs(spare);
+  summary->port = ntohs(port);
+  return 0;
+}
+
+frame_t* tree_handoff_frame(uint32_t origin, struct sockaddr_in* to, uint16_t extra) {
+  char payload[TREE_HANDOFF_SIZE];
+  memset(payload, 0, TREE_HANDOFF_SIZE);
+  if(to != NULL) {
+    // Already in network order
+    memcpy(payload, &to->sin_addr.s_addr, 4);
+    memcpy(payload + 4, &to->sin_port, 2);
+  }
+  extra = htons(extra);
+  memcpy(payload + 6, &extra, 2);
+  return frame_create(FRAME_HANDOFF, origin, 0, payload, TREE_HANDOFF_SIZE);
+}
+
+int tree_read_handoff(frame_t* frame, struct sockaddr_in* to, uint16_t* extra) {
+  if(frame->type != FRAME_HANDOFF || frame->length != TREE_HANDOFF_SIZE) {
+    return -1;
+  }
+  memset(to, 0, sizeof(struct sockaddr_in));
+  to->sin_family = AF_INET;
+  memcpy(&to->sin_addr.s_addr, frame->payload, 4);
+  memcpy(&to->sin_port, frame->payload + 4, 2);
+  memcpy(extra, frame->payload + 6, 2);
+  *extra = ntohs(*extra);
+  return 0;
+}
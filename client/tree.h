@@ -0,0 +1,116 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+/**
+ * Neighbors keep each other told where they sit in the tree, so it can
+ * reshape itself after it's built. Every few seconds each peer sends its
+ * parent a FRAME_SUMMARY of its subtree and each child a FRAME_PLACE saying
+ * how deep it is and where the child's grandparent can be reached.
+ *
+ * A parent invites its tallest child to move up to the grandparent when the
+ * grandparent has room. Moving up makes every peer in that subtree one hop
+ * closer to the root and makes no one else farther away, so repeated moves
+ * only ever shorten the tree, and it settles with the tallest subtrees as
+ * high as the fan-out allows. The child keeps reading its old parent until
+ * it has joined the grandparent, then sends the old parent a FRAME_HANDOFF
+ * naming where it went. The old parent stops relaying to it, since the
+ * grandparent now does, and hangs up once it has sent what it had queued.
+ *
+ * A peer that leaves on purpose hands its children on instead of just
+ * hanging up. It picks the child with the most room to take its place and
+ * sends it a FRAME_HANDOFF naming its own parent, or telling it to become
+ * the root. The other children are sent to that child while it has room,
+ * then to the leaving peer's parent while it has room, and any left over to
+ * that child anyway, which is told to take that many over its limit.
+ *
+ * Each child connects straight to the peer it's given, so none of them has
+ * to ask the directory. It keeps reading the leaving peer meanwhile, and
+ * once it has moved, answers with a FRAME_HANDOFF of its own to say it's
+ * gone. The leaving peer relays for its children until they all have, so
+ * no message is lost in between. A child sends its parent the same frame
+ * when it is the one leaving, so the parent gives its place to the heir.
+ * Both say port 0, so the parent keeps relaying to the child until it
+ * hangs up.
+ *
+ * FRAME_PLACE payload:   depth (2) | spare (2) | grandparent ip (4) | grandparent port (2) |
+ *                        grandparent spare (2) | promote (4)
+ * FRAME_SUMMARY payload: size (4) | height (2) | spare (2) | port (2)
+ * FRAME_HANDOFF payload: new parent ip (4) | new parent port (2), or port 0 to become the root |
+ *                        extra children to take (2)
+ */
+#define TREE_PLACE_SIZE 16
+#define TREE_SUMMARY_SIZE 10
+#define TREE_HANDOFF_SIZE 8
+
+// Invites no child to move up
+#define TREE_NO_PROMOTE 0xffffffff
+
+// How often neighbors trade places and summaries, give or take half of it
+#define TREE_INTERVAL_MS 2000
+// The least time between two moves by the same peer, in seconds
+#define TREE_MOVE_COOLDOWN 10
+
+typedef struct tree_place {
+  uint16_t depth;                  // The sender's depth; the root is 0
+  uint16_t spare;                  // Children the sender has room for
+  struct sockaddr_in grandparent;  // The sender's parent; port 0 if it has none
+  uint16_t grandparent_spare;      // Children the sender's parent has room for
+  uint32_t promote;                // Directory id of the child invited to move up
+} tree_place_t;
+
+typedef struct tree_summary {
+  uint32_t size;     // Peers in the subtree, counting its root
+  uint16_t height;   // Hops from the subtree's root to its deepest peer
+  uint16_t spare;    // Children the sender has room for
+  uint16_t port;     // The port the sender takes children on; 0 if unknown
+} tree_summary_t;
+
+/**
+ * Build a FRAME_PLACE frame for a child.
+ */
+frame_t* tree_place_frame(uint32_t origin, tree_place_t* place);
+
+/**
+ * Read a FRAME_PLACE frame.
+ *
+ * \returns 0 on success, -1 if the frame is malformed.
+ */
+int tree_read_place(frame_t* frame, tree_place_t* place);
+
+/**
+ * Build a FRAME_SUMMARY frame for our parent.
+ */
+frame_t* tree_summary_frame(uint32_t origin, tree_summary_t* summary);
+
+/**
+ * Read a FRAME_SUMMARY frame.
+ *
+ * \returns 0 on success, -1 if the frame is malformed.
+ */
+int tree_read_summary(frame_t* frame, tree_summary_t* summary);
+
+/**
+ * Build a FRAME_HANDOFF frame.
+ *
+ * \param to     Where the child should reattach, or NULL to make it the root.
+ * \param extra  How many of its siblings it should take over its limit.
+ */
+frame_t* tree_handoff_frame(uint32_t origin, struct sockaddr_in* to, uint16_t extra);
+
+/**
+ * Read a FRAME_HANDOFF frame.
+ *
+ * \param to     Filled in with where to reattach; its port is 0 if we're to
+ *               become the root.
+ * \param extra  Filled in with how many siblings to take over our limit.
+ *
+ * \returns 0 on success, -1 if the frame is malformed.
+ */
+int tree_read_handoff(frame_t* frame, struct sockaddr_in* to, uint16_t* extra);
+
+#endif
@@ -1,27 +1,69 @@
 #include "ui.h"
 
 #include <curses.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "history.h"
+#include "ring.h"
+
 #define WIDTH 78
 #define CHAT_HEIGHT 24
 #define INPUT_HEIGHT 1
 #define USERNAME_DISPLAY_MAX 8
+// Longest line ui_read_input accepts. Only the tail that fits is displayed.
+#define INPUT_MAX (64 * 1024)
+
+// Messages waiting for the renderer. Must be a power of two.
+#define PENDING_CAPACITY 4096
+// The renderer redraws at most this many times per second
+#define FRAME_RATE 30
+// How long the input loop sleeps when no key is waiting
+#define INPUT_POLL_US 10000
+// Messages moved by one press of Page Up or Page Down
+#define SCROLL_STEP (CHAT_HEIGHT / 2)
 
 WINDOW* mainwin;
 WINDOW* chatwin;
+WINDOW* chatpad;
 WINDOW* inputwin;
-  
-char* messages[CHAT_HEIGHT];
-size_t num_messages = 0;
+
+// A message queued by ui_add_message and owned by the renderer
+typedef struct ui_message {
+  char* username;
+  char* message;
+} ui_message_t;
+
+ring_t* pending;
+atomic_size_t dropped_messages;
+atomic_bool renderer_running;
+pthread_t renderer_thread;
+
+// Scrollback state. The offset counts messages back from the newest one.
+history_t* ui_history = NULL;
+atomic_uint_fast64_t scroll_offset;
+atomic_bool redraw_needed;
+
+// ncurses is not thread-safe, so the renderer and the input loop take turns
+pthread_mutex_t screen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* ui_render_thread_fn(void* p);
 
 /**
  * Initialize the chat user interface. Call this once at startup.
  */
 void ui_init() {
+  pending = ring_create(PENDING_CAPACITY);
+  if(pending == NULL) {
+    fprintf(stderr, "Failed to allocate message queue\n");
+    exit(EXIT_FAILURE);
+  }
+
   // Create the main window
   mainwin = initscr();
   if(mainwin == NULL) {
@@ -35,87 +77,218 @@ void ui_init() {
   // Create the chat window
   chatwin = subwin(mainwin, CHAT_HEIGHT + 2, WIDTH + 2, 0, 0);
   box(chatwin, 0, 0);
+
+  // Messages are drawn inside the border, in a region that scrolls by itself
+  // so a new line costs one scroll instead of a full repaint
+  chatpad = derwin(chatwin, CHAT_HEIGHT, WIDTH, 1, 1);
+  scrollok(chatpad, TRUE);
+  idlok(chatpad, TRUE);
   
   // Create the input window
   inputwin = subwin(mainwin, INPUT_HEIGHT + 2, WIDTH + 2, CHAT_HEIGHT + 2, 0);
   box(inputwin, 0, 0);
+  nodelay(inputwin, TRUE);
+  keypad(inputwin, TRUE);
   
   // Refresh the display
   refresh();
+
+  // Start drawing messages in the background
+  atomic_store(&renderer_running, true);
+  if(pthread_create(&renderer_thread, NULL, ui_render_thread_fn, NULL)) {
+    perror("pthread_create failed");
+    exit(EXIT_FAILURE);
+  }
 }
 
-// Clear the chat window (refresh required)
-void ui_clear_chat() {
-  for(int i=0; i<WIDTH; i++) {
-    for(int j=0; j<CHAT_HEIGHT; j++) {
-      mvwaddch(chatwin, 1+j, 1+i, ' ');
-    }
+/**
+ * Let the chat window scroll back through a history with Page Up and Page
+ * Down. Messages that should be reachable this way must be appended to the
+ * history by the caller; the UI only reads it.
+ *
+ * \param history  The history to read. This function does *not* take
+ *                 ownership of it, and it must outlive the UI.
+ */
+void ui_set_history(history_t* history) {
+  ui_history = history;
+}
+
+// Copy a string, dropping a trailing newline left over from the network
+char* ui_copy_line(char* str) {
+  if(str == NULL) {
+    return strdup("");
   }
+  size_t len = strcspn(str, "\r\n");
+  char* copy = malloc(sizeof(char) * (len + 1));
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
 }
 
 /**
  * Add a message to the chat window. If username is NULL, the message is
  * indented by two spaces.
  *
+ * This only queues the message; it never touches the terminal, so it is safe
+ * to call from any thread and returns immediately. If the renderer falls far
+ * behind, the message is dropped from the display and counted instead.
+ *
  * \param username  The username string. Truncated to 8 characters by default.
  *                  This function does *not* take ownership of this memory.
  * \param message   The message string. This function does *not* take ownership
  *                  of this memory.
  */
 void ui_add_message(char* username, char* message) {
-  // Clear the chat window
-  ui_clear_chat();
-  
-  // Free the oldest message if it will be lost
-  if(num_messages == CHAT_HEIGHT) {
-    free(messages[CHAT_HEIGHT-1]);
-  } else {
-    num_messages++;
+  ui_message_t* m = malloc(sizeof(ui_message_t));
+  m->username = username == NULL ? NULL : ui_copy_line(username);
+  m->message = ui_copy_line(message);
+
+  if(!ring_push(pending, m)) {
+    atomic_fetch_add(&dropped_messages, 1);
+    free(m->username);
+    free(m->message);
+    free(m);
   }
-  
-  // Move messages up
-  memmove(&messages[1], &messages[0], sizeof(char*) * (CHAT_HEIGHT - 1));
-  
-  // Make space for the username and message
-  messages[0] = malloc(sizeof(char*) * (WIDTH + 1));
-  
-  // Keep track of where we are in the message string
+}
+
+void ui_free_message(ui_message_t* m) {
+  free(m->username);
+  free(m->message);
+  free(m);
+}
+
+// Scroll the chat region up by one and write a line at the bottom (refresh required)
+void ui_draw_line(char* line) {
+  scroll(chatpad);
+  mvwaddnstr(chatpad, CHAT_HEIGHT - 1, 0, line, WIDTH);
+}
+
+// Draw one message, wrapping it across as many lines as needed (refresh required)
+void ui_draw_message(ui_message_t* m) {
+  char line[WIDTH + 1];
   size_t offset = 0;
   
   // Add the username, or indent two spaces if there isn't one
-  if(username == NULL) {
-    messages[0][0] = ' ';
-    messages[0][1] = ' ';
+  if(m->username == NULL) {
+    line[0] = ' ';
+    line[1] = ' ';
     offset = 2;
-  } else if(strlen(username) > USERNAME_DISPLAY_MAX) {
-    strncpy(messages[0], username, USERNAME_DISPLAY_MAX-3);
+  } else if(strlen(m->username) > USERNAME_DISPLAY_MAX) {
+    strncpy(line, m->username, USERNAME_DISPLAY_MAX-3);
     offset = USERNAME_DISPLAY_MAX-3;
-    messages[0][offset++] = '.';
-    messages[0][offset++] = '.';
-    messages[0][offset++] = '.';
-    messages[0][offset++] = ':';
-    messages[0][offset++] = ' ';
+    line[offset++] = '.';
+    line[offset++] = '.';
+    line[offset++] = '.';
+    line[offset++] = ':';
+    line[offset++] = ' ';
   } else {
-    strcpy(messages[0], username);
-    offset = strlen(username);
-    messages[0][offset++] = ':';
-    messages[0][offset++] = ' ';
+    strcpy(line, m->username);
+    offset = strlen(m->username);
+    line[offset++] = ':';
+    line[offset++] = ' ';
+  }
+
+  // Continuation lines are indented like a message without a username
+  char* rest = m->message;
+  size_t remaining = strlen(rest);
+  do {
+    size_t n = remaining > WIDTH - offset ? WIDTH - offset : remaining;
+    memcpy(&line[offset], rest, n);
+    line[offset + n] = '\0';
+    ui_draw_line(line);
+    rest += n;
+    remaining -= n;
+    line[0] = ' ';
+    line[1] = ' ';
+    offset = 2;
+  } while(remaining > 0);
+}
+
+// Repaint the chat window from the history at the current scroll offset (refresh required)
+void ui_draw_history() {
+  uint64_t count = history_count(ui_history);
+  uint64_t offset = atomic_load(&scroll_offset);
+  uint64_t end = count - offset;
+  uint64_t start = end > CHAT_HEIGHT ? end - CHAT_HEIGHT : 0;
+
+  werase(chatpad);
+  for(uint64_t i = start; i < end; i++) {
+    ui_message_t m;
+    history_entry_t entry;
+    if(history_get(ui_history, i, &entry)) {
+      m.username = entry.username;
+      m.message = entry.message;
+      ui_draw_message(&m);
+      history_entry_free(&entry);
+    }
+  }
+  if(offset > 0) {
+    char notice[WIDTH + 1];
+    snprintf(notice, sizeof(notice), "  -- %llu newer messages, Page Down to return --",
+             (unsigned long long)offset);
+    ui_draw_line(notice);
   }
+}
+
+/**
+ * Drain queued messages and draw them, at most FRAME_RATE times per second.
+ * Only the messages that can still be seen are drawn; older ones in the same
+ * frame would scroll straight off the screen.
+ */
+void* ui_render_thread_fn(void* p) {
+  ui_message_t* visible[CHAT_HEIGHT];
   
-  // If characters remain, add them in another message
-  if(strlen(message) > WIDTH - offset) {
-    strncpy(&messages[0][offset], message, WIDTH - offset);
-    ui_add_message(NULL, &message[WIDTH - offset]);
-  } else {
-    strcpy(&messages[0][offset], message);
-    
-    // Display the messages
-    for(int i=0; i<num_messages; i++) {
-      mvwaddstr(chatwin, CHAT_HEIGHT - i, 1, messages[i]);
+  while(atomic_load(&renderer_running)) {
+    usleep(1000000 / FRAME_RATE);
+
+    // Keep the newest CHAT_HEIGHT messages; every message takes at least a line
+    size_t count = 0;
+    ui_message_t* m;
+    while((m = ring_pop(pending)) != NULL) {
+      if(count == CHAT_HEIGHT) {
+        ui_free_message(visible[0]);
+        memmove(&visible[0], &visible[1], sizeof(ui_message_t*) * (CHAT_HEIGHT - 1));
+        count--;
+      }
+      visible[count++] = m;
     }
-    wrefresh(chatwin);
-    wrefresh(inputwin);
+
+    size_t dropped = atomic_exchange(&dropped_messages, 0);
+    // Messages the queue had to drop can still be shown from the history
+    bool redraw = atomic_exchange(&redraw_needed, false) || (dropped > 0 && ui_history != NULL);
+    if(count == 0 && dropped == 0 && !redraw) {
+      continue;
+    }
+
+    pthread_mutex_lock(&screen_lock);
+    if(redraw || atomic_load(&scroll_offset) > 0) {
+      // The view comes from the history, so the queued copies aren't needed.
+      // While scrolled back, new messages don't move the view.
+      for(size_t i = 0; i < count; i++) {
+        ui_free_message(visible[i]);
+      }
+      count = 0;
+      dropped = 0;
+      if(redraw) {
+        ui_draw_history();
+      }
+    }
+    if(dropped > 0) {
+      char notice[WIDTH + 1];
+      snprintf(notice, sizeof(notice), "  (%zu messages not shown)", dropped);
+      ui_draw_line(notice);
+    }
+    for(size_t i = 0; i < count; i++) {
+      ui_draw_message(visible[i]);
+      ui_free_message(visible[i]);
+    }
+    // Push both windows out in one update so the cursor stays in the input box
+    wnoutrefresh(chatpad);
+    wnoutrefresh(inputwin);
+    doupdate();
+    pthread_mutex_unlock(&screen_lock);
   }
+  return NULL;
 }
 
 // Clear the input window (refresh required)
@@ -136,11 +309,39 @@ char* ui_read_input() {
   int c;
   
   // Allocate space to hold an input line
-  char* buffer = malloc(sizeof(char) * (WIDTH + 1));
+  char* buffer = malloc(sizeof(char) * (INPUT_MAX + 1));
   buffer[0] = '\0';
   
   // Loop until we get a newline
-  while((c = getch()) != '\n') {
+  while(true) {
+    // Poll for a key so the renderer can use the screen while we wait
+    pthread_mutex_lock(&screen_lock);
+    c = wgetch(inputwin);
+    pthread_mutex_unlock(&screen_lock);
+    if(c == ERR) {
+      usleep(INPUT_POLL_US);
+      continue;
+    } else if(c == '\n') {
+      break;
+    }
+
+    // Page Up and Page Down scroll through the history instead of editing
+    if((c == KEY_PPAGE || c == KEY_NPAGE) && ui_history != NULL) {
+      uint64_t offset = atomic_load(&scroll_offset);
+      uint64_t count = history_count(ui_history);
+      if(c == KEY_PPAGE) {
+        offset += SCROLL_STEP;
+        if(offset >= count) {
+          offset = count > 0 ? count - 1 : 0;
+        }
+      } else {
+        offset = offset > SCROLL_STEP ? offset - SCROLL_STEP : 0;
+      }
+      atomic_store(&scroll_offset, offset);
+      atomic_store(&redraw_needed, true);
+      continue;
+    }
+
     // Is this a backspace or a new character?
     if(c == KEY_BACKSPACE || c == KEY_DC || c == 127) {
       // Delete the last character
@@ -148,22 +349,26 @@ char* ui_read_input() {
         length--;
         buffer[length] = '\0';
       }
-    } else if(length < WIDTH) {
+    } else if(length < INPUT_MAX && c < KEY_MIN) {
       // Add the new character, unless we're at the length limit
       buffer[length] = c;
       buffer[length+1] = '\0';
       length++;
     }
     
-    // Clear the previous input and re-display it
+    // Clear the previous input and re-display it, scrolled to show the end
+    pthread_mutex_lock(&screen_lock);
     ui_clear_input();
-    mvwaddstr(inputwin, 1, 1, buffer);
+    mvwaddstr(inputwin, 1, 1, length > WIDTH ? &buffer[length - WIDTH] : buffer);
     wrefresh(inputwin);
+    pthread_mutex_unlock(&screen_lock);
   }
   
   // Clear the input and refresh the display
+  pthread_mutex_lock(&screen_lock);
   ui_clear_input();
   wrefresh(inputwin);
+  pthread_mutex_unlock(&screen_lock);
   
   return buffer;
 }
@@ -172,8 +377,19 @@ char* ui_read_input() {
  * Shut down the user interface. Call this once during shutdown.
  */
 void ui_shutdown() {
+  // Stop the renderer before tearing down the windows it draws to
+  atomic_store(&renderer_running, false);
+  pthread_join(renderer_thread, NULL);
+
+  ui_message_t* m;
+  while((m = ring_pop(pending)) != NULL) {
+    ui_free_message(m);
+  }
+  ring_destroy(pending);
+
   // Clean up windows and ncurses stuff
   delwin(inputwin);
+  delwin(chatpad);
   delwin(chatwin);
   delwin(mainwin);
   endwin();
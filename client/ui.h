@@ -1,15 +1,31 @@
 #ifndef UI_H
 #define UI_H
 
+#include "history.h"
+
 /**
  * Initialize the chat user interface. Call this once at startup.
  */
 void ui_init();
 
+/**
+ * Let the chat window scroll back through a history with Page Up and Page
+ * Down. Messages that should be reachable this way must be appended to the
+ * history by the caller; the UI only reads it.
+ *
+ * \param history  The history to read. This function does *not* take
+ *                 ownership of it, and it must outlive the UI.
+ */
+void ui_set_history(history_t* history);
+
 /**
  * Add a message to the chat window. If username is NULL, the message is
  * indented by two spaces.
  *
+ * This only queues the message; it never touches the terminal, so it is safe
+ * to call from any thread and returns immediately. If the renderer falls far
+ * behind, the message is dropped from the display and counted instead.
+ *
  * \param username  The username string. Truncated to 8 characters by default.
  *                  This function does *not* take ownership of this memory.
  * \param message   The message string. This function does *not* take ownership
@@ -0,0 +1,183 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+int uring_setup(unsigned entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int uring_register(int fd, unsigned opcode, void* arg, unsigned count) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+uring_t* uring_create(unsigned entries, size_t buffer_size, int buffer_count) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = uring_setup(entries, &params);
+  if(fd == -1) {
+    return NULL;
+  }
+
+  uring_t* uring = calloc(1, sizeof(uring_t));
+  uring->fd = fd;
+  uring->entries = params.sq_entries;
+
+  // Map the rings; newer kernels put both in one mapping
+  uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if(single && uring->cq_ring_size > uring->sq_ring_size) {
+    uring->sq_ring_size = uring->cq_ring_size;
+  }
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd, IORING_OFF_SQ_RING);
+  if(uring->sq_ring == MAP_FAILED) {
+    close(fd);
+    free(uring);
+    return NULL;
+  }
+  uring->cq_ring = uring->sq_ring;
+  if(!single) {
+    uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+    if(uring->cq_ring == MAP_FAILED) {
+      munmap(uring->sq_ring, uring->sq_ring_size);
+      close(fd);
+      free(uring);
+      return NULL;
+    }
+  }
+  uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  char* sq = uring->sq_ring;
+  uring->sq_head = (unsigned*)(sq + params.sq_off.head);
+  uring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  uring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned*)(sq + params.sq_off.array);
+  char* cq = uring->cq_ring;
+  uring->cq_head = (unsigned*)(cq + params.cq_off.head);
+  uring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  uring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  // One allocation for every buffer, registered with the kernel once
+  uring->buffer_size = buffer_size;
+  uring->buffer_count = buffer_count;
+  uring->buffers = mmap(NULL, buffer_size * buffer_count, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  struct iovec* iovecs = malloc(sizeof(struct iovec) * buffer_count);
+  for(int i = 0; i < buffer_count; i++) {
+    iovecs[i].iov_base = uring->buffers + i * buffer_size;
+    iovecs[i].iov_len = buffer_size;
+  }
+  int registered = uring->sqes == MAP_FAILED || uring->buffers == MAP_FAILED ? -1 :
+                   uring_register(fd, IORING_REGISTER_BUFFERS, iovecs, buffer_count);
+  free(iovecs);
+  if(registered == -1) {
+    uring_destroy(uring);
+    return NULL;
+  }
+  return uring;
+}
+
+char* uring_buffer(uring_t* uring, int index) {
+  return uring->buffers + index * uring->buffer_size;
+}
+
+// Claim the next submission entry, or NULL if the ring is full
+struct io_uring_sqe* uring_next(uring_t* uring) {
+  unsigned head = atomic_load_explicit((_Atomic unsigned*)uring->sq_head, memory_order_acquire);
+  unsigned tail = *uring->sq_tail + uring->queued;
+  if(tail - head >= uring->entries) {
+    return NULL;
+  }
+  unsigned index = tail & *uring->sq_mask;
+  struct io_uring_sqe* sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  uring->sq_array[index] = index;
+  uring->queued++;
+  return sqe;
+}
+
+int uring_write_fixed(uring_t* uring, int fd, int index, size_t length, uint64_t user_data) {
+  struct io_uring_sqe* sqe = uring_next(uring);
+  if(sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)uring_buffer(uring, index);
+  sqe->len = length;
+  sqe->buf_index = index;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int uring_read(uring_t* uring, int fd, void* buffer, size_t length, uint64_t user_data) {
+  struct io_uring_sqe* sqe = uring_next(uring);
+  if(sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = length;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int uring_submit(uring_t* uring, unsigned wait_for) {
+  // Publish the new entries before telling the kernel about them
+  unsigned to_submit = uring->queued;
+  atomic_store_explicit((_Atomic unsigned*)uring->sq_tail, *uring->sq_tail + to_submit,
+                        memory_order_release);
+  uring->queued = 0;
+  while(uring_enter(uring->fd, to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0) == -1) {
+    if(errno != EINTR) {
+      return -1;
+    }
+    // Anything not taken the first time stays in the ring for the kernel to find
+    to_submit = 0;
+  }
+  return 0;
+}
+
+int uring_complete(uring_t* uring, uint64_t* user_data, int* result) {
+  unsigned head = *uring->cq_head;
+  if(head == atomic_load_explicit((_Atomic unsigned*)uring->cq_tail, memory_order_acquire)) {
+    return 0;
+  }
+  struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+  *user_data = cqe->user_data;
+  *result = cqe->res;
+  atomic_store_explicit((_Atomic unsigned*)uring->cq_head, head + 1, memory_order_release);
+  return 1;
+}
+
+void uring_destroy(uring_t* uring) {
+  if(uring->buffers != NULL && uring->buffers != MAP_FAILED) {
+    munmap(uring->buffers, uring->buffer_size * uring->buffer_count);
+  }
+  if(uring->sqes != NULL && uring->sqes != MAP_FAILED) {
+    munmap(uring->sqes, uring->entries * sizeof(struct io_uring_sqe));
+  }
+  if(uring->cq_ring != uring->sq_ring) {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+  munmap(uring->sq_ring, uring->sq_ring_size);
+  close(uring->fd);
+  free(uring);
+}
@@ -0,0 +1,106 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A minimal io_uring, driven by raw system calls so nothing beyond kernel
+ * headers is needed. Writes are queued on the submission ring and handed
+ * to the kernel together, so any number of them costs one io_uring_enter.
+ * Writes come from buffers registered with the kernel once up front, which
+ * saves it from mapping user memory on every write.
+ *
+ * Only sends go through the ring. Receives, including multishot ones, are
+ * not used: each link's reader thread still reads its own socket, since it
+ * reassembles frames, returns credit and switches the link to shared memory
+ * inline. Moving that onto one ring would mean provided-buffer rings and a
+ * dispatcher handing frames to every link, a larger change than batching
+ * the writes.
+ */
+typedef struct uring {
+  int fd;
+  unsigned entries;
+
+  // The submission ring, shared with the kernel
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned queued;         // Entries added since the last submission
+
+  // The completion ring, shared with the kernel
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+
+  // The registered buffers, buffer_count of buffer_size bytes each
+  char* buffers;
+  size_t buffer_size;
+  int buffer_count;
+} uring_t;
+
+/**
+ * Set up a ring with registered buffers.
+ *
+ * \param entries       The most operations in flight at once.
+ * \param buffer_size   The size of each registered buffer.
+ * \param buffer_count  The number of registered buffers.
+ *
+ * \returns The ring, or NULL if the kernel doesn't support io_uring.
+ */
+uring_t* uring_create(unsigned entries, size_t buffer_size, int buffer_count);
+
+/**
+ * Get one of the registered buffers.
+ */
+char* uring_buffer(uring_t* uring, int index);
+
+/**
+ * Queue a write from a registered buffer.
+ *
+ * \param user_data  Returned with the write's completion.
+ *
+ * \returns 0 on success, -1 if the submission ring is full.
+ */
+int uring_write_fixed(uring_t* uring, int fd, int index, size_t length, uint64_t user_data);
+
+/**
+ * Queue a plain read into ordinary memory.
+ *
+ * \returns 0 on success, -1 if the submission ring is full.
+ */
+int uring_read(uring_t* uring, int fd, void* buffer, size_t length, uint64_t user_data);
+
+/**
+ * Submit everything queued and wait until at least wait_for operations
+ * have completed.
+ *
+ * \returns 0 on success, -1 on error.
+ */
+int uring_submit(uring_t* uring, unsigned wait_for);
+
+/**
+ * Take the next completion, if there is one.
+ *
+ * \param user_data  Receives the user_data it was queued with.
+ * \param result     Receives its result: bytes transferred, or -errno.
+ *
+ * \returns 1 if a completion was taken, 0 if there were none.
+ */
+int uring_complete(uring_t* uring, uint64_t* user_data, int* result);
+
+/**
+ * Tear down the ring.
+ */
+void uring_destroy(uring_t* uring);
+
+#endif
@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,17 +10,32 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <math.h>
+#include <time.h>
 
 
 #define CJOIN 1
 #define RQNEW 2
 #define CEXIT 3
 
+// Joins let in per second, overall and from any one address, and how many may come at once
+#define JOIN_RATE 20.0
+#define JOIN_BURST 40.0
+#define SOURCE_JOIN_RATE 5.0
+#define SOURCE_JOIN_BURST 10.0
+// Turned-away joins are spread over up to this much more, so they don't all come back at once
+#define RETRY_JITTER_MS 250
+// A source's bucket is dropped once it has been idle this long
+#define SOURCE_IDLE_SECONDS 60.0
+// We serve one connection at a time, so one that goes quiet is given up on after this long
+#define CLIENT_TIMEOUT_SECONDS 5
+
+// A client in the list; it owns all of its strings
 typedef struct client{
   char* name;
   int id;
   int port;
   char* ip_addr;
+  char* zone;
 }client_t;
 
 typedef struct node{
@@ -27,9 +43,164 @@ typedef struct node{
   struct node *next;
 }node_t;
 
+// A token bucket: each join takes a token, and tokens come back at a steady rate
+typedef struct bucket{
+  double tokens;
+  double rate;
+  double burst;
+  double last;
+}bucket_t;
+
+// The bucket for joins from one address
+typedef struct source{
+  in_addr_t addr;
+  bucket_t bucket;
+  struct source* next;
+}source_t;
+
 int client_count = 0;
 node_t* client_list = NULL;
 
+bucket_t join_bucket = { JOIN_BURST, JOIN_RATE, JOIN_BURST, 0 };
+source_t* sources = NULL;
+// Joins we've turned away that haven't come due yet; drains at JOIN_RATE
+double retry_backlog = 0;
+double retry_backlog_time = 0;
+
+double now_seconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add the tokens that have come back since the bucket was last looked at
+void bucket_refill(bucket_t* bucket, double now){
+  bucket->tokens = fmin(bucket->burst, bucket->tokens + (now - bucket->last) * bucket->rate);
+  bucket->last = now;
+}
+
+// Seconds until the bucket has a whole token
+double bucket_wait(bucket_t* bucket){
+  return bucket->tokens >= 1 ? 0 : (1 - bucket->tokens) / bucket->rate;
+}
+
+// Find the bucket for an address, dropping any that have sat idle
+source_t* find_source(in_addr_t addr, double now){
+  source_t* found = NULL;
+  source_t** p = &sources;
+  while(*p != NULL){
+    source_t* src = *p;
+    if(src->addr == addr){
+      found = src;
+    }else if(now - src->bucket.last > SOURCE_IDLE_SECONDS){
+      *p = src->next;
+      free(src);
+      continue;
+    }
+    p = &src->next;
+  }
+  if(found == NULL){
+    found = malloc(sizeof(source_t));
+    found->addr = addr;
+    found->bucket = (bucket_t){ SOURCE_JOIN_BURST, SOURCE_JOIN_RATE, SOURCE_JOIN_BURST, now };
+    found->next = sources;
+    sources = found;
+  }
+  return found;
+}
+
+/**
+ * Decide whether to serve a join or tell it to come back later. A join is
+ * let in if there's a token both overall and for its address.
+ *
+ * \param source  The address the join came from.
+ *
+ * \returns 0 to serve it, otherwise how many milliseconds it should wait.
+ */
+int admit_join(struct in_addr source){
+  double now = now_seconds();
+  bucket_refill(&join_bucket, now);
+  source_t* src = find_source(source.s_addr, now);
+  bucket_refill(&src->bucket, now);
+  retry_backlog = fmax(0, retry_backlog - (now - retry_backlog_time) * JOIN_RATE);
+  retry_backlog_time = now;
+
+  if(join_bucket.tokens >= 1 && src->bucket.tokens >= 1){
+    join_bucket.tokens -= 1;
+    src->bucket.tokens -= 1;
+    return 0;
+  }
+  // Each join turned away comes back behind the ones before it, so a storm becomes a ramp
+  double wait = fmax(bucket_wait(&join_bucket), bucket_wait(&src->bucket));
+  wait += retry_backlog / JOIN_RATE;
+  retry_backlog += 1;
+  return (int)(wait * 1000) + 1 + random() % RETRY_JITTER_MS;
+}
+
+// Send a client every peer that joined before it, those in its zone first
+void list_candidates(FILE* output, int client_id, char* zone){
+  for(int pass = 0; pass < 2; pass++){
+    for(node_t* temp = client_list; temp != NULL; temp = temp->next){
+      client_t* c = temp->client;
+      bool same_zone = strcmp(c->zone, zone) == 0;
+      if(c->id < client_id && same_zone == (pass == 0)){
+        fprintf(output, "%s#!%s#!%d#!%d#!%s#!\n", c->name, c->ip_addr, c->id, c->port, c->zone);
+      }
+    }
+  }
+  fflush(output);
+}
+
+/**
+ * Parse the line a joining client describes itself with:
+ * name#!ip#!id#!port#![zone#!]
+ *
+ * \param req     The line, which strtok cuts up. Not owned by this function.
+ * \param source  The address the client connected from, used if it listens on every interface.
+ *
+ * \returns The client, or NULL if the line is malformed.
+ */
+client_t* parse_client(char* req, char* source){
+  req[strcspn(req, "\n")] = '\0';
+  char* name = strtok(req, "#!");
+  char* ip_addr = strtok(NULL, "#!");
+  char* id = strtok(NULL, "#!");
+  char* port = strtok(NULL, "#!");
+  // Older clients don't report a zone
+  char* zone = strtok(NULL, "#!");
+  if(name == NULL || ip_addr == NULL || id == NULL || port == NULL){
+    return NULL;
+  }
+  // A client listening on every interface can be reached at the address it came from
+  if(strcmp(ip_addr, "0.0.0.0") == 0){
+    ip_addr = source;
+  }
+  client_t* client = (client_t*)malloc(sizeof(client_t));
+  client->name = strdup(name);
+  client->ip_addr = strdup(ip_addr);
+  client->id = atoi(id);
+  client->port = atoi(port);
+  client->zone = strdup(zone == NULL ? "" : zone);
+  return client;
+}
+
+void client_free(client_t* client){
+  free(client->name);
+  free(client->ip_addr);
+  free(client->zone);
+  free(client);
+}
+
+// Find a client's zone by id ("" if it never told us)
+char* find_zone(int client_id){
+  for(node_t* temp = client_list; temp != NULL; temp = temp->next){
+    if(temp->client->id == client_id){
+      return temp->client->zone;
+    }
+  }
+  return "";
+}
+
 int main(int argc, char* argv[]) {
   // Set up a socket
   int s = socket(AF_INET, SOCK_STREAM, 0);
@@ -51,8 +222,11 @@ int main(int argc, char* argv[]) {
     exit(2);
   }
 
-  // Become a server socket
-  listen(s, 2);
+  // Become a server socket, with room for a crowd of joins to wait their turn
+  listen(s, SOMAXCONN);
+  srandom(time(NULL) ^ getpid());
+  // A client hanging up before we answer mustn't take the server down with it
+  signal(SIGPIPE, SIG_IGN);
 
   // Get the listening socket info so we can find out which port we're using
   socklen_t addr_size = sizeof(struct sockaddr_in);
@@ -68,6 +242,12 @@ int main(int argc, char* argv[]) {
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(struct sockaddr_in);
     int client_socket = accept(s, (struct sockaddr*)&client_addr, &client_addr_len);
+    if(client_socket == -1){
+      continue;
+    }
+    // Reads give up on a client that goes quiet, rather than stall everyone behind it
+    struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT_SECONDS, .tv_usec = 0 };
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
     // Duplicate the client_socket so we can open it twice, once for input and once for output
     int client_socket_copy = dup(client_socket);
@@ -86,45 +266,54 @@ int main(int argc, char* argv[]) {
       exit(EXIT_FAILURE);
     }
 
-    // Read lines until we hit the end of the input (the client disconnects)
+    // Read the command; a client that hung up or timed out sends none
     char *line = NULL;
     size_t linecap = 0;
-    getline(&line, &linecap, input);
-    // Print a message on the server
-    int command = atoi(line);
+    int command = getline(&line, &linecap, input) == -1 ? 0 : atoi(line);
     int client_id = -1;
-    if(command==CEXIT){
-      getline(&line, &linecap, input);
-      client_id = atoi(line);
-      node_t *temp = client_list;
-      while(temp->next != NULL){
-        if(temp->client->id == client_id){
-          node_t* delete = temp->next;
-          temp->client = temp->next->client;
-          temp->next = delete->next;
-          free(delete);
-        }else{
-          temp = temp->next;
+    if(command==RQNEW){
+      // Read the whole request, so answering early doesn't reset the connection
+      client_id = getline(&line, &linecap, input) == -1 ? -1 : atoi(line);
+    }
+    // Joins and rejoins are throttled; a peer leaving never is
+    int retry_ms = command == CJOIN || command == RQNEW ? admit_join(client_addr.sin_addr) : 0;
+    if(retry_ms > 0){
+      fprintf(output, "RETRY %d\n", retry_ms);
+      fflush(output);
+    }
+    else if(command==CEXIT){
+      client_id = getline(&line, &linecap, input) == -1 ? -1 : atoi(line);
+      // Unlink the client wherever it is in the list, first and last included
+      node_t **p = &client_list;
+      while(*p != NULL){
+        if((*p)->client->id == client_id){
+          node_t* gone = *p;
+          *p = gone->next;
+          client_free(gone->client);
+          free(gone);
+          break;
         }
+        p = &(*p)->next;
       }
-      close(client_socket);
     }
     else if(command==CJOIN){
-      fprintf(output, "%d\n", client_count);
+      // Tell the client its id and the address we see it at, so it can tell which peers share its host
+      char source[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &client_addr.sin_addr, source, INET_ADDRSTRLEN);
+      fprintf(output, "%d#!%s\n", client_count, source);
       fflush(output);
 
-      char *parse_req = NULL;
-
-      if(getline(&parse_req, &linecap, input) == -1){
-        perror("getline failed.");
-        exit(EXIT_FAILURE);
+      // A client that hangs up, goes quiet or sends garbage here is never added
+      client_t *new_client = NULL;
+      if(getline(&line, &linecap, input) != -1){
+        new_client = parse_client(line, source);
+      }
+      if(new_client == NULL){
+        free(line);
+        fclose(input);
+        fclose(output);
+        continue;
       }
-      client_t *new_client = (client_t*)malloc(sizeof(client_t));
-
-      new_client->name = strtok(parse_req, "#!");
-      new_client->ip_addr = strtok(NULL, "#!");
-      new_client->id = atoi(strtok(NULL, "#!"));
-      new_client->port = atoi(strtok(NULL, "#!"));
 
       node_t *new_node = (node_t*)malloc(sizeof(node_t));
       new_node->client = new_client;
@@ -142,46 +331,10 @@ int main(int argc, char* argv[]) {
         client_id = client_count;
         client_count++;
       }
+      list_candidates(output, client_id, new_client->zone);
 
     }else if(command==RQNEW){
-      getline(&line, &linecap, input);
-      client_id = atoi(line);
-    }
-    node_t *temp = client_list;
-    while(temp->next != NULL && temp->client->id < client_id && temp != NULL){
-      char* name = temp->client->name;
-      char* ip_addr = temp->client->ip_addr;
-      int id_int = temp->client->id;
-      int port_int = temp->client->port;
-
-      int id_len, port_len = 1;
-      if(id_int > 0){
-        id_len = (int) log10(id_int);
-      }
-      if(port_int > 0){
-        port_len = (int) log10(port_int);
-      }
-
-      char* id = (char*)malloc(sizeof(char)*id_len);
-      char* port = (char*)malloc(sizeof(char)*port_len);
-
-      sprintf(id, "%d", id_int);
-      sprintf(port, "%d", port_int);
-
-      int reqstring_len = strlen(name) + strlen(ip_addr) + strlen(id) + strlen(port) + 8;
-      char *reqstring = (char*)malloc(reqstring_len*sizeof(char) + 1);
-      strcpy(reqstring, name);
-      strcpy(reqstring + strlen(name), "#!");
-      strcpy(reqstring + strlen(name) + 2, ip_addr);
-      strcpy(reqstring + strlen(name) + strlen(ip_addr) + 2, "#!");
-      strcpy(reqstring + strlen(name) + strlen(ip_addr) + 4, id);
-      strcpy(reqstring + strlen(name) + strlen(ip_addr) + strlen(id) + 4, "#!");
-      strcpy(reqstring + strlen(name) + strlen(ip_addr) + strlen(id) + 6, port);
-      strcpy(reqstring + strlen(name) + strlen(ip_addr) + strlen(id) + strlen(port) + 6, "#!");
-
-      fprintf(output, "%s\n", reqstring);
-      fflush(output);
-      temp = temp->next;
+      list_candidates(output, client_id, find_zone(client_id));
     }
     free(line);
     fclose(input);